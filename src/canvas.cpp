@@ -1,5 +1,13 @@
 #include "canvas.h"
+#include "canvas_snapshot.h"
+#include "image_formats.h"
+#include "png_writer.h"
+#include "save_queue.h"
+#include "thread_pool.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cmath>
 #include <stdio.h>
 #include <string.h>
@@ -22,20 +30,120 @@ using namespace agl;
  * 
 */
 
+// Side length of the square screen tiles that end() bins primitives into
+const int TILE_SIZE= 64;
+
+// Below this many primitives binning costs more than it saves
+const int MIN_BINNED_PRIMITIVES= 64;
+
+// Number of flow seeds that are integrated together
+const int FLOW_BATCH_SIZE= 4096;
+
+// Bounds on the number of points along a rose
+const int MIN_ROSE_POINTS= 16;
+const int MAX_ROSE_POINTS= 100;
+
 // Function to clamp value
 int clamp(int value, int low, int hi) 
 {
   return std::min(std::max(value, low), hi);
 }
 
+// Bytes per canvas pixel (RGB)
+const int PIXEL_BYTES= 3;
+
+/**
+ * Blend policies for the rasterizers. They blend a color straight into
+ * the RGB bytes of the canvas, pixel() for one pixel and span() for
+ * count pixels in a row. The rasterizers are templated on them so the
+ * blend type is picked once per draw and the blend is inlined into the
+ * pixel loops. The results are the same bytes as Image's replaceColor,
+ * addColor and alphaColor.
+*/
+struct ReplaceBlend {
+  void pixel(unsigned char* px, const Pixel& p) const
+  {
+    px[0]= p.r;
+    px[1]= p.g;
+    px[2]= p.b;
+  }
+
+  void span(unsigned char* px, int count, const Pixel& p) const
+  {
+    for (int i= 0; i < count; i++, px+= PIXEL_BYTES) {
+      this->pixel(px, p);
+    }
+  }
+};
+
+struct AddBlend {
+  void pixel(unsigned char* px, const Pixel& p) const
+  {
+    px[0]= std::min(px[0] + p.r, 255);
+    px[1]= std::min(px[1] + p.g, 255);
+    px[2]= std::min(px[2] + p.b, 255);
+  }
+
+  void span(unsigned char* px, int count, const Pixel& p) const
+  {
+    for (int i= 0; i < count; i++, px+= PIXEL_BYTES) {
+      this->pixel(px, p);
+    }
+  }
+};
+
+struct AlphaBlend {
+  float alpha;
+
+  void pixel(unsigned char* px, const Pixel& p) const
+  {
+    float keep= 1 - this->alpha;
+    px[0]= (float) px[0] * keep + (float) p.r * this->alpha;
+    px[1]= (float) px[1] * keep + (float) p.g * this->alpha;
+    px[2]= (float) px[2] * keep + (float) p.b * this->alpha;
+  }
+
+  void span(unsigned char* px, int count, const Pixel& p) const
+  {
+    // the color's share is the same along the span
+    float keep= 1 - this->alpha;
+    float red= (float) p.r * this->alpha;
+    float green= (float) p.g * this->alpha;
+    float blue= (float) p.b * this->alpha;
+    for (int i= 0; i < count; i++, px+= PIXEL_BYTES) {
+      px[0]= (float) px[0] * keep + red;
+      px[1]= (float) px[1] * keep + green;
+      px[2]= (float) px[2] * keep + blue;
+    }
+  }
+};
+
+// Calls draw with the blend policy of the given blend type
+template <class Draw>
+void withBlend(BlendType type, float alpha, Draw draw)
+{
+  switch (type) {
+    case REPLACE:
+      draw(ReplaceBlend());
+      break;
+    case ADD:
+      draw(AddBlend());
+      break;
+    case ALPHA:
+      draw(AlphaBlend {alpha});
+      break;
+  }
+}
+
 // Although the original Perlin algorithm
 // uses a permutation array to hold the gradients
 // I use the wikipedia's pseudo generation one
-void pseudoGradientGenerator(int grid_x, int grid_y, float& grad_x, float& grad_y)
+void pseudoGradientGenerator(int grid_x, int grid_y, unsigned seed, 
+  float& grad_x, float& grad_y)
 {
   const unsigned w= 8 * sizeof(unsigned);
   const unsigned s= w / 2;
-  unsigned a= grid_x, b= grid_y;
+  unsigned a= grid_x, b= grid_y ^ (seed * 2654435761u);
 
   a *= 3284157443; b ^= a << s | a >> (w - s);
   b *= 1911520717; a ^= b << s | b >> (w - s);
@@ -53,10 +161,10 @@ float LERP(float a, float b, float alpha)
 }
 
 // computes the dot product of the point x, y and gradient point
-float dotGradient(int grid_x, int grid_y, float x, float y)
+float dotGradient(int grid_x, int grid_y, float x, float y, unsigned seed)
 {
   float grad_x, grad_y;
-  pseudoGradientGenerator(grid_x, grid_y, grad_x, grad_y);
+  pseudoGradientGenerator(grid_x, grid_y, seed, grad_x, grad_y);
 
 
   // calculate distance vector
@@ -67,7 +175,7 @@ float dotGradient(int grid_x, int grid_y, float x, float y)
   return dx*grad_x + dy*grad_y;
 }
 
-float perlin(float x, float y)
+float perlin(float x, float y, unsigned seed)
 {
   // get the gradient bounding box
   int x0= (int) floor(x);
@@ -79,12 +187,12 @@ float perlin(float x, float y)
   float sx= x - (float) x0;
   float sy= y - (float) y0;
 
-  float n0= dotGradient(x0, y0, x, y);
-  float n1= dotGradient(x1, y0, x, y);
+  float n0= dotGradient(x0, y0, x, y, seed);
+  float n1= dotGradient(x1, y0, x, y, seed);
   float aux_x1= LERP(n0, n1, sx);
 
-  n0= dotGradient(x0, y1, x, y);
-  n1= dotGradient(x1, y1, x, y);
+  n0= dotGradient(x0, y1, x, y, seed);
+  n1= dotGradient(x1, y1, x, y, seed);
   float aux_x2= LERP(n0, n1, sx);
 
   float value= LERP(aux_x1, aux_x2, sy); // [-1, 1]
@@ -100,20 +208,6 @@ float Canvas::mapValue(float value, float start, float end, float newStart, floa
   return newValue;
 }
 
-void Canvas::_colorPixel(int x, int y, const Pixel& p) {
-  switch (this->currentBlendType) {
-    case REPLACE:
-      this->_canvas.replaceColor(x, y, p);
-      break;
-    case ADD:
-      this->_canvas.addColor(x, y, p);
-      break;
-    case ALPHA:
-      this->_canvas.alphaColor(x, y, p, this->currentAlpha);
-      break;
-  }
-}
-
 Canvas::Canvas(int w, int h) : _canvas(w, h)
 {
   // Allow for a 50% buffer if lines were to loop back
@@ -133,20 +227,15 @@ Canvas::Canvas(int w, int h) : _canvas(w, h)
   this->flowField.nCols= (this->flowField.max_x - this->flowField.min_x) 
     / this->flowField.resolution;
 
-  this->flowField.field= std::vector<float>(this->flowField.nRows * 
-    this->flowField.nCols);
-
-
-  for (int y= 0; y < this->flowField.nRows; y++) {
-    for (int x= 0; x < this->flowField.nCols; x++) {
-      float scaled_x= x * 0.005;
-      float scaled_y= y * 0.005;
-      float angle= perlin(scaled_x, scaled_y);
-      angle= mapValue(angle, 0, 1, 0, 2 * M_PI);
-
-      this->flowField.field[y * this->flowField.nCols + x]= angle;
-    }
-  }
+  // the angles are only generated once drawFlow looks them up
+  this->flowField.nTileRows= (this->flowField.nRows + FLOW_TILE_SIZE - 1) 
+    / FLOW_TILE_SIZE;
+  this->flowField.nTileCols= (this->flowField.nCols + FLOW_TILE_SIZE - 1) 
+    / FLOW_TILE_SIZE;
+  this->flowField.tiles.resize(this->flowField.nTileRows * this->flowField.nTileCols);
+  this->flowField.scale= 0.005;
+  this->flowField.seed= 0;
+  this->flowField.cacheChecked= false;
 
   // this will determine the length of each curve
   this->flowField.numSteps= (int) ceil(this->_canvas.height() * 0.1);
@@ -155,6 +244,10 @@ Canvas::Canvas(int w, int h) : _canvas(w, h)
 
 Canvas::~Canvas()
 {
+  // the snapshots may still read the canvas
+  for (const std::shared_future<bool>& saved: this->myPendingSaves) {
+    saved.wait();
+  }
 }
 
 void Canvas::save(const std::string& filename)
@@ -162,6 +255,38 @@ void Canvas::save(const std::string& filename)
   _canvas.save(filename);
 }
 
+std::shared_future<bool> Canvas::saveAsync(const std::string& filename)
+{
+  // forget the saves that have finished
+  auto done= [](const std::shared_future<bool>& saved) {
+    return saved.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  };
+  this->myPendingSaves.erase(std::remove_if(this->myPendingSaves.begin(), 
+    this->myPendingSaves.end(), done), this->myPendingSaves.end());
+  this->mySnapshots.erase(std::remove_if(this->mySnapshots.begin(), 
+    this->mySnapshots.end(), [](const std::weak_ptr<CanvasSnapshot>& snapshot) {
+      return snapshot.expired();
+    }), this->mySnapshots.end());
+
+  std::shared_ptr<CanvasSnapshot> snapshot= std::make_shared<CanvasSnapshot>(
+    this->_canvas.data(), this->_canvas.width(), this->_canvas.height(), TILE_SIZE);
+  this->mySnapshots.push_back(snapshot);
+  std::shared_future<bool> saved= SaveQueue::shared().push([snapshot, filename] {
+    return writeImage(filename, snapshot->pixels(), snapshot->width(), 
+      snapshot->height(), false, PNG_DEFAULT_LEVEL, JPG_DEFAULT_QUALITY);
+  });
+  this->myPendingSaves.push_back(saved);
+  return saved;
+}
+
+void Canvas::_preserveSnapshots(const ClipRect& rect)
+{
+  for (const std::weak_ptr<CanvasSnapshot>& weak: this->mySnapshots) {
+    std::shared_ptr<CanvasSnapshot> snapshot= weak.lock();
+    if (snapshot) snapshot->preserve(rect.x_min, rect.y_min, rect.x_max, rect.y_max);
+  }
+}
+
 void Canvas::begin(PrimitiveType primitiveType, BlendType blendType, float alpha)
 {
   // should not be calling begin before ending
@@ -173,7 +298,7 @@ void Canvas::begin(PrimitiveType primitiveType, BlendType blendType, float alpha
 
 void Canvas::end()
 {
-  int n= this->myPoints.size();
+  int n= this->myVertices.size();
   switch (this->currentPrimitiveType) {
     case UNDEFINED:
       std::cout << "Should not be drawing in UNDEFINED mode" << std::endl;
@@ -184,11 +309,7 @@ void Canvas::end()
         break;
       }
 
-      for (int i= 0; i < n; i+=2) {
-        Point p1= this->myPoints[i];
-        Point p2= this->myPoints[i+1];
-        this->drawLine(p1, p2);
-      }
+      this->_rasterize(LINES, this->myVertices);
       break; 
     case TRIANGLES:
       if (n % 3 != 0) {
@@ -196,38 +317,33 @@ void Canvas::end()
         break;
       }
 
-      for (int i= 0; i < n; i+=3) {
-        Point p0= this->myPoints[i];
-        Point p1= this->myPoints[i+1];
-        Point p2= this->myPoints[i+2];
-        this->drawTriangle(p0, p1, p2);
-      }
+      this->_rasterize(TRIANGLES, this->myVertices);
       break;
     case CIRCLES:
-      if (n != this->myRadii.size()) {
+      if (n != this->myVertices.radius.size()) {
         std::cout << "(NO DRAW) Not a vector of circle points" << std::endl;
         break;
       }
-      for (int i= 0; i < n; i++) {
-        this->drawCircle(this->myPoints[i], this->myRadii[i]);
-      }
+      this->_rasterize(CIRCLES, this->myVertices);
       break;
-    case ROSES:
-      if (n != this->myRadii.size() || n != this->myNumPetals.size()) {
+    case ROSES: {
+      if (n != this->myVertices.radius.size() || n != this->myVertices.petals.size()) {
         std::cout << "(NO DRAW) Not a vector of rose points" << std::endl;
         break;
       }
 
+      VertexBuffer segments;
       for (int i= 0; i < n; i++) {
-        this->drawRose(this->myPoints[i], this->myRadii[i], this->myNumPetals[i]);
+        this->_roseSegments(this->myVertices.point(i), this->myVertices.radius[i], 
+          this->myVertices.petals[i], segments);
       }
+      this->_rasterize(LINES, segments);
       break;
+    }
     case FLOW:
-      for (Point p: this->myPoints) {
-        this->drawFlow(p);
-      }
+      this->_drawFlows(this->myVertices);
       break;
-    case POLYGON:
+    case POLYGON: {
       // if less than 2, then we simply have a line, point, or nothing
       if (n < 2) {
         std::cout << "(NO DRAW) Not a valid polygon" << std::endl;
@@ -237,17 +353,312 @@ void Canvas::end()
         std::cout << "(NO DRAW) Please also input a palette of colors" << endl;
         break;
       }
-      this->packCircles(this->myPoints, this->myPalette);
+      std::vector<Point> polygon;
+      for (int i= 0; i < n; i++) {
+        polygon.push_back(this->myVertices.point(i));
+      }
+      this->packCircles(polygon, this->myPalette);
       break;
+    }
   }
   this->currentPrimitiveType= UNDEFINED;
   this->currentBlendType= REPLACE;
-  this->myPoints.clear();
-  this->myRadii.clear();
-  this->myNumPetals.clear();
+  this->myVertices.clear();
   this->myPalette.clear();
 }
 
+ClipRect Canvas::_canvasRect() const
+{
+  return ClipRect {0, 0, this->_canvas.width()-1, this->_canvas.height()-1};
+}
+
+unsigned char* Canvas::_pixelAddress(int x, int y)
+{
+  return this->_canvas.data() + 
+    ((size_t) y * this->_canvas.width() + x) * PIXEL_BYTES;
+}
+
+template <class Blend>
+void Canvas::_rasterPrimitive(const Blend& blend, PrimitiveType type, 
+  const VertexBuffer& vertices, int i, const ClipRect& clip)
+{
+  switch (type) {
+    case LINES:
+      this->_drawLine(blend, vertices.point(2*i), vertices.point(2*i+1), clip);
+      break;
+    case TRIANGLES:
+      this->_drawTriangle(blend, vertices.point(3*i), vertices.point(3*i+1), 
+        vertices.point(3*i+2), clip);
+      break;
+    case CIRCLES:
+      this->_drawCircle(blend, vertices.point(i), vertices.radius[i], clip);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Sorts the primitives into TILE_SIZE x TILE_SIZE tiles by their
+ * bounding boxes, then rasterizes the tiles in parallel. The bins are
+ * filled in submission order and a tile only writes its own pixels,
+ * so every pixel sees the same sequence of blends as a serial draw.
+*/
+void Canvas::_rasterize(PrimitiveType type, const VertexBuffer& vertices)
+{
+  withBlend(this->currentBlendType, this->currentAlpha, [&](const auto& blend) {
+    this->_rasterizeTiles(blend, type, vertices);
+  });
+}
+
+template <class Blend>
+void Canvas::_rasterizeTiles(const Blend& blend, PrimitiveType type, 
+  const VertexBuffer& vertices)
+{
+  int stride= (type == LINES) ? 2 : (type == TRIANGLES) ? 3 : 1;
+  int count= vertices.size() / stride;
+  ClipRect canvasRect= this->_canvasRect();
+
+  ThreadPool& pool= ThreadPool::shared();
+  if (pool.threadCount() == 1 || count < MIN_BINNED_PRIMITIVES) {
+    if (!this->mySnapshots.empty() && count > 0) {
+      // the bounds of the whole batch
+      ClipRect bounds {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+      for (int i= 0; i < count * stride; i++) {
+        int r= (type == CIRCLES) ? vertices.radius[i] : 0;
+        bounds.x_min= min(bounds.x_min, vertices.x[i] - r);
+        bounds.y_min= min(bounds.y_min, vertices.y[i] - r);
+        bounds.x_max= max(bounds.x_max, vertices.x[i] + r);
+        bounds.y_max= max(bounds.y_max, vertices.y[i] + r);
+      }
+      this->_preserveSnapshots(bounds);
+    }
+    for (int i= 0; i < count; i++) {
+      this->_rasterPrimitive(blend, type, vertices, i, canvasRect);
+    }
+    return;
+  }
+
+  int tilesX= (this->_canvas.width() + TILE_SIZE - 1) / TILE_SIZE;
+  int tilesY= (this->_canvas.height() + TILE_SIZE - 1) / TILE_SIZE;
+  int numTiles= tilesX * tilesY;
+
+  // the range of tiles each primitive overlaps (empty if it is off canvas)
+  std::vector<ClipRect> tileRanges(count);
+  std::vector<int> offsets(numTiles + 1, 0);
+  for (int i= 0; i < count; i++) {
+    int x_min, y_min, x_max, y_max;
+    if (type == CIRCLES) {
+      x_min= vertices.x[i] - vertices.radius[i];
+      x_max= vertices.x[i] + vertices.radius[i];
+      y_min= vertices.y[i] - vertices.radius[i];
+      y_max= vertices.y[i] + vertices.radius[i];
+    } else {
+      const int* x= &vertices.x[i * stride];
+      const int* y= &vertices.y[i * stride];
+      x_min= x_max= x[0];
+      y_min= y_max= y[0];
+      for (int k= 1; k < stride; k++) {
+        x_min= min(x_min, x[k]);
+        x_max= max(x_max, x[k]);
+        y_min= min(y_min, y[k]);
+        y_max= max(y_max, y[k]);
+      }
+    }
+    x_min= max(x_min, canvasRect.x_min);
+    y_min= max(y_min, canvasRect.y_min);
+    x_max= min(x_max, canvasRect.x_max);
+    y_max= min(y_max, canvasRect.y_max);
+
+    ClipRect& range= tileRanges[i];
+    if (x_min > x_max || y_min > y_max) {
+      range= ClipRect {0, 0, -1, -1};
+      continue;
+    }
+    range= ClipRect {x_min / TILE_SIZE, y_min / TILE_SIZE, 
+      x_max / TILE_SIZE, y_max / TILE_SIZE};
+    for (int ty= range.y_min; ty <= range.y_max; ty++) {
+      for (int tx= range.x_min; tx <= range.x_max; tx++) {
+        offsets[ty * tilesX + tx + 1]++;
+      }
+    }
+  }
+
+  // turn the counts into offsets, then fill the bins in submission order
+  for (int t= 0; t < numTiles; t++) {
+    offsets[t+1]+= offsets[t];
+  }
+  std::vector<int> bins(offsets[numTiles]);
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  for (int i= 0; i < count; i++) {
+    const ClipRect& range= tileRanges[i];
+    for (int ty= range.y_min; ty <= range.y_max; ty++) {
+      for (int tx= range.x_min; tx <= range.x_max; tx++) {
+        bins[fill[ty * tilesX + tx]++]= i;
+      }
+    }
+  }
+
+  pool.parallelFor(numTiles, [&](int t) {
+    int tx= t % tilesX;
+    int ty= t / tilesX;
+    ClipRect tile {tx * TILE_SIZE, ty * TILE_SIZE, 
+      min((tx+1) * TILE_SIZE, this->_canvas.width()) - 1,
+      min((ty+1) * TILE_SIZE, this->_canvas.height()) - 1};
+
+    if (offsets[t] < offsets[t+1]) this->_preserveSnapshots(tile);
+    for (int k= offsets[t]; k < offsets[t+1]; k++) {
+      this->_rasterPrimitive(blend, type, vertices, bins[k], tile);
+    }
+  });
+}
+
+void Canvas::flowSeed(unsigned seed)
+{
+  this->flowField.seed= seed;
+  this->flowField.cacheChecked= false;
+  for (std::vector<float>& tile: this->flowField.tiles) {
+    tile.clear();
+  }
+}
+
+void Canvas::flowCache(const std::string& directory)
+{
+  this->flowField.cacheDirectory= directory;
+  this->flowField.cacheChecked= false;
+}
+
+const float* Canvas::_flowDirection(int idx)
+{
+  FlowField& field= this->flowField;
+  if (!field.cacheChecked) {
+    field.cacheChecked= true;
+    if (!field.cacheDirectory.empty() && !this->_loadFlowCache()) {
+      this->_saveFlowCache();
+    }
+  }
+
+  int row= idx / field.nCols;
+  int col= idx % field.nCols;
+  int tile= (row / FLOW_TILE_SIZE) * field.nTileCols + col / FLOW_TILE_SIZE;
+  if (field.tiles[tile].empty()) {
+    this->_generateFlowTile(tile);
+  }
+  return &field.tiles[tile][2 * ((row % FLOW_TILE_SIZE) * FLOW_TILE_SIZE + col % FLOW_TILE_SIZE)];
+}
+
+void Canvas::_generateFlowTile(int tile)
+{
+  FlowField& field= this->flowField;
+  std::vector<float>& directions= field.tiles[tile];
+  directions.resize(2 * FLOW_TILE_SIZE * FLOW_TILE_SIZE);
+
+  int row_start= (tile / field.nTileCols) * FLOW_TILE_SIZE;
+  int col_start= (tile % field.nTileCols) * FLOW_TILE_SIZE;
+  int row_end= min(row_start + FLOW_TILE_SIZE, field.nRows);
+  int col_end= min(col_start + FLOW_TILE_SIZE, field.nCols);
+
+  for (int y= row_start; y < row_end; y++) {
+    for (int x= col_start; x < col_end; x++) {
+      float scaled_x= x * field.scale;
+      float scaled_y= y * field.scale;
+      float angle= perlin(scaled_x, scaled_y, field.seed);
+      angle= mapValue(angle, 0, 1, 0, 2 * M_PI);
+
+      float* direction= &directions[2 * ((y - row_start) * FLOW_TILE_SIZE + (x - col_start))];
+      direction[0]= std::cos(angle);
+      direction[1]= std::sin(angle);
+    }
+  }
+}
+
+/**
+ * The cache file is named after everything the field depends on
+ * and starts with the same values, followed by the directions of
+ * each tile in order.
+*/
+const char FLOW_CACHE_MAGIC[8]= {'A', 'G', 'L', 'F', 'L', 'O', 'W', '2'};
+
+struct FlowCacheHeader {
+  char magic[8];
+  int width;
+  int height;
+  int resolution;
+  int nRows;
+  int nCols;
+  unsigned seed;
+  double scale;
+};
+
+std::string Canvas::_flowCacheFile() const
+{
+  char name[128];
+  snprintf(name, sizeof(name), "flow-%dx%d-r%d-s%.9g-%u.bin", 
+    this->_canvas.width(), this->_canvas.height(), this->flowField.resolution,
+    this->flowField.scale, this->flowField.seed);
+  return this->flowField.cacheDirectory + "/" + name;
+}
+
+FlowCacheHeader flowCacheHeader(const Image& canvas, const FlowField& field)
+{
+  FlowCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FLOW_CACHE_MAGIC, sizeof(header.magic));
+  header.width= canvas.width();
+  header.height= canvas.height();
+  header.resolution= field.resolution;
+  header.nRows= field.nRows;
+  header.nCols= field.nCols;
+  header.seed= field.seed;
+  header.scale= field.scale;
+  return header;
+}
+
+bool Canvas::_loadFlowCache()
+{
+  FILE* file= fopen(this->_flowCacheFile().c_str(), "rb");
+  if (file == nullptr) return false;
+
+  FlowCacheHeader expected= flowCacheHeader(this->_canvas, this->flowField);
+  FlowCacheHeader header;
+  bool success= fread(&header, sizeof(header), 1, file) == 1 &&
+    memcmp(&header, &expected, sizeof(header)) == 0;
+
+  std::vector<std::vector<float>>& tiles= this->flowField.tiles;
+  for (int i= 0; success && i < tiles.size(); i++) {
+    tiles[i].resize(2 * FLOW_TILE_SIZE * FLOW_TILE_SIZE);
+    success= fread(tiles[i].data(), sizeof(float), tiles[i].size(), file) == tiles[i].size();
+  }
+  fclose(file);
+
+  if (!success) {
+    std::cout << "Ignoring invalid flow field cache " << this->_flowCacheFile() << std::endl;
+    for (std::vector<float>& tile: tiles) {
+      tile.clear();
+    }
+  }
+  return success;
+}
+
+bool Canvas::_saveFlowCache()
+{
+  FILE* file= fopen(this->_flowCacheFile().c_str(), "wb");
+  if (file == nullptr) {
+    std::cout << "Cannot write flow field cache " << this->_flowCacheFile() << std::endl;
+    return false;
+  }
+
+  FlowCacheHeader header= flowCacheHeader(this->_canvas, this->flowField);
+  bool success= fwrite(&header, sizeof(header), 1, file) == 1;
+
+  std::vector<std::vector<float>>& tiles= this->flowField.tiles;
+  for (int i= 0; success && i < tiles.size(); i++) {
+    if (tiles[i].empty()) this->_generateFlowTile(i);
+    success= fwrite(tiles[i].data(), sizeof(float), tiles[i].size(), file) == tiles[i].size();
+  }
+  fclose(file);
+  return success;
+}
 
 void Canvas::numSteps(int steps)
 {
@@ -267,112 +678,275 @@ void Canvas::stepLength(int length)
   }
 }
 
-// drawLine helper function for when |H| > |W|
-void Canvas::_drawLineHigh(const Point& p1, const Point& p2) 
+// Division that rounds towards negative infinity (b > 0)
+long long floorDiv(long long a, long long b)
 {
-   int x= p1.x;
-   int W= p2.x - p1.x;
-   int H= p2.y - p1.y;
-   int dx= 1;
-   // make sure we go in the right y-direction
-   if (W < 0) {
+  return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// Division that rounds towards positive infinity (b > 0)
+long long ceilDiv(long long a, long long b)
+{
+  return -floorDiv(-a, b);
+}
+
+/**
+ * Both line helpers walk the major axis one step at a time. After k
+ * steps Bresenham has moved n_k = floor((2*minor*k + major - 1) / (2*major))
+ * along the minor axis and its decision variable is
+ * F_k = 2*minor*(k+1) - major - 2*major*n_k. Since n_k only grows,
+ * the steps that stay inside the clip form one range [k_min, k_max]
+ * that we can solve for (Liang-Barsky style), and then jump straight
+ * to k_min. The pixels drawn are the same as walking the whole line.
+ *
+ * The color alpha is k / major, so the color is stepped in 16.16
+ * fixed point instead of being measured with distances per pixel.
+*/
+
+// Narrows [k_min, k_max] to the steps whose minor coordinate
+// start + dir * n_k lies in [low, high]. Returns false if none do
+bool clipMinorAxis(int start, int dir, int low, int high, 
+  long long major, long long minor, long long& k_min, long long& k_max)
+{
+  // the number of minor steps n_k has to lie in [n_low, n_high]
+  long long n_low= (dir > 0) ? low - start : start - high;
+  long long n_high= (dir > 0) ? high - start : start - low;
+  if (n_high < 0) return false;
+
+  if (minor == 0) {
+    // n_k is always 0
+    return n_low <= 0;
+  }
+  if (n_low > 0) {
+    k_min= max(k_min, ceilDiv(2*major*n_low - major + 1, 2*minor));
+  }
+  k_max= min(k_max, floorDiv(2*major*(n_high + 1) - major, 2*minor));
+  return k_min <= k_max;
+}
+
+// drawLine helper function for when |H| >= |W|, p1 is the top point
+template <class Blend>
+void Canvas::_drawLineHigh(const Blend& blend, const Point& p1, const Point& p2, 
+  const ClipRect& clip) 
+{
+  long long W= p2.x - p1.x;
+  long long H= p2.y - p1.y;
+  int dx= 1;
+  // make sure we go in the right x-direction
+  if (W < 0) {
     dx= -1;
     W= -W;
-   }
-   int F= 2*W - H;
-   for (int y= p1.y; y <= p2.y; y++) {
-      // interpolates color   
-      float num= sqrt(pow(x - p1.x, 2) + pow(y - p1.y, 2));
-      float denom= sqrt(pow(p2.x - p1.x, 2) + pow(p2.y - p1.y, 2));
-      // do not want to divide by 0
-      float alpha= (denom < 1) ? 0 : num/denom;
-
-      Pixel newColor= Canvas::interpolateColor(p1.color, p2.color, alpha);
-      this->_colorPixel(x, y, newColor);
-      if (F > 0) {
-        x+= dx;
-        F+= 2*(W - H);
-      } else {
-        F+= 2*W;
-      }
-   }
-}
-
-// drawLine helper function for when |W| > |H|
-void Canvas::_drawLineLow(const Point& p1, const Point& p2) 
-{
-   int y= p1.y;
-   int W= p2.x - p1.x;
-   int H= p2.y - p1.y;
-
-   int dy= 1;
-   // make sure we go in the right y-direction
-   if (H < 0) {
-      dy= -1;
-      H= -H;
-   }
-   int F= 2*H - W;
-   for (int x= p1.x; x <= p2.x; x++) {
-      // interpolates color   
-      float num= sqrt(pow(x - p1.x, 2) + pow(y - p1.y, 2));
-      float denom= sqrt(pow(p2.x - p1.x, 2) + pow(p2.y - p1.y, 2));
-      // do not want to divide by 0
-      float alpha= (denom < 1) ? 0 : num/denom;
-
-      Pixel newColor= Canvas::interpolateColor(p1.color, p2.color, alpha);
-      this->_colorPixel(x, y, newColor);
-      if (F > 0) {
-        y+= dy;
-        F+= 2*(H-W);
-      } else {
-        F+= 2*H;
-      }
-   }
-}
+  }
 
-void Canvas::drawLine(Point& p1, Point& p2) {
-  int W= p2.x - p1.x;
-  int H= p2.y - p1.y;
+  if (H == 0) {
+    // both points are the same pixel
+    if (p1.x >= clip.x_min && p1.x <= clip.x_max && 
+        p1.y >= clip.y_min && p1.y <= clip.y_max) {
+      blend.pixel(this->_pixelAddress(p1.x, p1.y), p1.color);
+    }
+    return;
+  }
 
-  int canvasWidth= this->_canvas.width()-1;
-  int canvasHeight= this->_canvas.height()-1;
+  long long k_min= max(0LL, (long long) clip.y_min - p1.y);
+  long long k_max= min(H, (long long) clip.y_max - p1.y);
+  if (k_min > k_max || 
+      !clipMinorAxis(p1.x, dx, clip.x_min, clip.x_max, H, W, k_min, k_max)) {
+    return;
+  }
+
+  long long n= floorDiv(2*W*k_min + H - 1, 2*H);
+  long long F= 2*W*(k_min + 1) - H - 2*H*n;
+  int x= p1.x + dx * n;
+
+  // colors in 16.16 fixed point, starting half a step up to round
+  int r= (p1.color.r << 16) + (1 << 15);
+  int g= (p1.color.g << 16) + (1 << 15);
+  int b= (p1.color.b << 16) + (1 << 15);
+  int dr= (p2.color.r - p1.color.r) * 65536 / H;
+  int dg= (p2.color.g - p1.color.g) * 65536 / H;
+  int db= (p2.color.b - p1.color.b) * 65536 / H;
+  r+= dr * k_min;
+  g+= dg * k_min;
+  b+= db * k_min;
+
+  int rowBytes= this->_canvas.width() * PIXEL_BYTES;
+  unsigned char* px= this->_pixelAddress(x, p1.y + k_min);
+  for (long long k= k_min; k <= k_max; k++) {
+    Pixel newColor {(unsigned char) (r >> 16), (unsigned char) (g >> 16),
+      (unsigned char) (b >> 16)};
+    blend.pixel(px, newColor);
+    px+= rowBytes;
+    r+= dr;
+    g+= dg;
+    b+= db;
+    if (F > 0) {
+      px+= dx * PIXEL_BYTES;
+      F+= 2*(W - H);
+    } else {
+      F+= 2*W;
+    }
+  }
+}
+
+// drawLine helper function for when |W| > |H|, p1 is the left point
+template <class Blend>
+void Canvas::_drawLineLow(const Blend& blend, const Point& p1, const Point& p2, 
+  const ClipRect& clip) 
+{
+  long long W= p2.x - p1.x;
+  long long H= p2.y - p1.y;
+  int dy= 1;
+  // make sure we go in the right y-direction
+  if (H < 0) {
+    dy= -1;
+    H= -H;
+  }
 
-  // if a points is off screen, then we don't want to draw the line
-  if (((p1.x < 0 || p1.x > canvasWidth) || (p1.y < 0 || p1.y > canvasHeight)) ||
-      ((p2.x < 0 || p2.x > canvasWidth) || (p2.y < 0 || p2.y > canvasHeight))) {
+  long long k_min= max(0LL, (long long) clip.x_min - p1.x);
+  long long k_max= min(W, (long long) clip.x_max - p1.x);
+  if (k_min > k_max || 
+      !clipMinorAxis(p1.y, dy, clip.y_min, clip.y_max, W, H, k_min, k_max)) {
     return;
   }
 
+  long long n= floorDiv(2*H*k_min + W - 1, 2*W);
+  long long F= 2*H*(k_min + 1) - W - 2*W*n;
+  int y= p1.y + dy * n;
+
+  // colors in 16.16 fixed point, starting half a step up to round
+  int r= (p1.color.r << 16) + (1 << 15);
+  int g= (p1.color.g << 16) + (1 << 15);
+  int b= (p1.color.b << 16) + (1 << 15);
+  int dr= (p2.color.r - p1.color.r) * 65536 / W;
+  int dg= (p2.color.g - p1.color.g) * 65536 / W;
+  int db= (p2.color.b - p1.color.b) * 65536 / W;
+  r+= dr * k_min;
+  g+= dg * k_min;
+  b+= db * k_min;
+
+  int rowStep= dy * this->_canvas.width() * PIXEL_BYTES;
+  unsigned char* px= this->_pixelAddress(p1.x + k_min, y);
+  for (long long k= k_min; k <= k_max; k++) {
+    Pixel newColor {(unsigned char) (r >> 16), (unsigned char) (g >> 16),
+      (unsigned char) (b >> 16)};
+    blend.pixel(px, newColor);
+    px+= PIXEL_BYTES;
+    r+= dr;
+    g+= dg;
+    b+= db;
+    if (F > 0) {
+      px+= rowStep;
+      F+= 2*(H-W);
+    } else {
+      F+= 2*H;
+    }
+  }
+}
+
+void Canvas::drawLine(Point& p1, Point& p2) {
+  ClipRect canvasRect= this->_canvasRect();
+  this->_preserveSnapshots(ClipRect {min(p1.x, p2.x), min(p1.y, p2.y), 
+    max(p1.x, p2.x), max(p1.y, p2.y)});
+  withBlend(this->currentBlendType, this->currentAlpha, [&](const auto& blend) {
+    this->_drawLine(blend, p1, p2, canvasRect);
+  });
+}
+
+// Lines with points off the canvas are clipped to it
+template <class Blend>
+void Canvas::_drawLine(const Blend& blend, const Point& p1, const Point& p2, 
+  const ClipRect& clip) {
+  int W= p2.x - p1.x;
+  int H= p2.y - p1.y;
+
   if (std::abs(H) < std::abs(W)) {
     // swap, so we go in the positive x-direction
-    if (p1.x > p2.x) this->_drawLineLow(p2, p1);
-    else this->_drawLineLow(p1, p2);
+    if (p1.x > p2.x) this->_drawLineLow(blend, p2, p1, clip);
+    else this->_drawLineLow(blend, p1, p2, clip);
   } else {
     // swap, so we go in the positive y-direction
-    if (p1.y > p2.y) this->_drawLineHigh(p2, p1);
-    else this->_drawLineHigh(p1, p2);
+    if (p1.y > p2.y) this->_drawLineHigh(blend, p2, p1, clip);
+    else this->_drawLineHigh(blend, p1, p2, clip);
   }
 }
 
 void Canvas::vertex(int x, int y)
 {
-  // clips vertex to image sizes
-  Point p;
-  p.x= clamp(x, 0, this->_canvas.width()-1);
-  p.y= clamp(y, 0, this->_canvas.height()-1);
-  p.color= this->currentColor;
-  
-  this->myPoints.push_back(p);
+  this->vertices(&x, &y, 1);
+}
+
+void Canvas::vertices(const int* xs, const int* ys, size_t n)
+{
+  VertexBuffer& buffer= this->myVertices;
+  size_t start= buffer.x.size();
+  buffer.x.resize(start + n);
+  buffer.y.resize(start + n);
+  buffer.color.resize(start + n, this->currentColor);
+
+  // clips vertices to image sizes
+  int x_max= this->_canvas.width()-1;
+  int y_max= this->_canvas.height()-1;
+  int* x= &buffer.x[start];
+  int* y= &buffer.y[start];
+  for (size_t i= 0; i < n; i++) {
+    x[i]= min(max(xs[i], 0), x_max);
+    y[i]= min(max(ys[i], 0), y_max);
+  }
   
   if (this->currentPrimitiveType == CIRCLES || this->currentPrimitiveType == ROSES) {
-    this->myRadii.push_back(this->currentRadius);
+    buffer.radius.resize(start + n, this->currentRadius);
+  }
+
+  if (this->currentPrimitiveType == ROSES) {
+    buffer.petals.resize(start + n, this->currentNumPetals);
   }
+}
 
+void Canvas::reserve(size_t n)
+{
+  VertexBuffer& buffer= this->myVertices;
+  buffer.reserve(buffer.size() + n);
+  if (this->currentPrimitiveType == CIRCLES || this->currentPrimitiveType == ROSES) {
+    buffer.radius.reserve(buffer.size() + n);
+  }
   if (this->currentPrimitiveType == ROSES) {
-    this->myNumPetals.push_back(this->currentNumPetals);
+    buffer.petals.reserve(buffer.size() + n);
   }
 }
 
+int VertexBuffer::size() const
+{
+  return this->x.size();
+}
+
+Point VertexBuffer::point(int i) const
+{
+  return Point {this->x[i], this->y[i], this->color[i]};
+}
+
+void VertexBuffer::push(const Point& p)
+{
+  this->x.push_back(p.x);
+  this->y.push_back(p.y);
+  this->color.push_back(p.color);
+}
+
+void VertexBuffer::reserve(size_t n)
+{
+  this->x.reserve(n);
+  this->y.reserve(n);
+  this->color.reserve(n);
+}
+
+void VertexBuffer::clear()
+{
+  this->x.clear();
+  this->y.clear();
+  this->color.clear();
+  this->radius.clear();
+  this->petals.clear();
+}
+
 void Canvas::palette(std::vector<Pixel> palette)
 {
   if (this->currentPrimitiveType == POLYGON) {
@@ -423,31 +997,12 @@ void Canvas::alpha(float alpha)
 void Canvas::background(unsigned char r, unsigned char g, unsigned char b)
 {
   Pixel p {r, g, b};
+  this->_preserveSnapshots(this->_canvasRect());
   for (int i= 0; i < this->_canvas.pixelCount(); i++) {
     this->_canvas.set(i, p);
   }
 }
 
-Pixel Canvas::interpolateColor(const Pixel& p1, const Pixel& p2, float alpha) 
-{
-  assert(0.0f <= alpha && alpha <= 1.0f);
-  Pixel result;
-  result.r= p1.r * (1 - alpha) + p2.r * alpha;
-  result.g= p1.g * (1 - alpha) + p2.g * alpha;
-  result.b= p1.b * (1 - alpha) + p2.b * alpha;
-
-  return result;
-}
-
-float Canvas::implicitLineFn(float linePt1_x, float linePt1_y, 
-  float linePt2_x, float linePt2_y,
-  float otherPt_x, float otherPt_y) 
-{
-  int H= linePt2_y - linePt1_y;
-  int W= linePt2_x - linePt1_x;
-  return H * (otherPt_x - linePt1_x) - W * (otherPt_y - linePt1_y);
-}
-
 void Canvas::findBoundingBox(std::vector<Point>& points,
   int& x_min, int& y_min, int& x_max, int& y_max) 
 {
@@ -470,66 +1025,124 @@ void Canvas::findBoundingBox(std::vector<Point>& points,
   }
 }
 
-/**
- * Since the canvas goes from top-left to bottom-right,
- * we put the left-most point as p0, then we choose from
- * the remaining two points with the higher y-value
- * as p1 to get the CCW orientation of points. 
- *
-*/
-void Canvas::rearrangeCCW(Point& p0, Point& p1, Point& p2) {
-  if (p1.x < p0.x && p1.x < p2.x) { // p1 is left-most
-    std::swap(p1, p0);
-  } else if (p2.x < p0.x && p2.x < p1.x) { // p2 is left-most
-    std::swap(p2, p0);
-  }
+// Integer edge function of the directed edge a -> b evaluated at (x, y).
+// It is positive on the interior side when the triangle has positive area
+int edgeFunction(const Point& a, const Point& b, int x, int y)
+{
+  return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+}
 
-  // See which has the bigger y-value and swap if its p2
-  if (p2.y > p1.y) std::swap(p1, p2);
+// Top-left fill rule: pixels lying exactly on an edge only belong to the
+// triangle if the edge is a top edge (horizontal, interior below it) or a
+// left edge (interior to its right). This is read off the edge's inward
+// gradient, so shared edges between two triangles are only drawn once
+bool isTopLeftEdge(const Point& a, const Point& b)
+{
+  return (a.y == b.y && b.x > a.x) || b.y < a.y;
 }
 
 void Canvas::drawTriangle(Point& p0, Point& p1, Point& p2) {
-  int x_min, y_min, x_max, y_max;
-  std::vector<Point> points;
-  points.push_back(p0);
-  points.push_back(p1);
-  points.push_back(p2);
-  Canvas::findBoundingBox(points, x_min, y_min, x_max, y_max);
-
-  Canvas::rearrangeCCW(p0, p1, p2);
+  ClipRect canvasRect= this->_canvasRect();
+  this->_preserveSnapshots(ClipRect {min({p0.x, p1.x, p2.x}), min({p0.y, p1.y, p2.y}), 
+    max({p0.x, p1.x, p2.x}), max({p0.y, p1.y, p2.y})});
+  withBlend(this->currentBlendType, this->currentAlpha, [&](const auto& blend) {
+    this->_drawTriangle(blend, p0, p1, p2, canvasRect);
+  });
+}
 
-  float f_alpha= this->implicitLineFn(p1.x, p1.y, p2.x, p2.y, p0.x, p0.y);
-  float f_beta= this->implicitLineFn(p2.x, p2.y, p0.x, p0.y, p1.x, p1.y);
-  float f_gamma= this->implicitLineFn(p0.x, p0.y, p1.x, p1.y, p2.x, p2.y);
+template <class Blend>
+void Canvas::_drawTriangle(const Blend& blend, Point p0, Point p1, Point p2, 
+  const ClipRect& clip) {
+  // twice the signed area, we flip the winding so that it is positive
+  int area= edgeFunction(p0, p1, p2.x, p2.y);
+  if (area == 0) return; // degenerate triangles cover no pixels
+  if (area < 0) {
+    std::swap(p1, p2);
+    area= -area;
+  }
 
-  // point to determine if an edge is part of the respective triangle
-  float offPoint_x= -1.1f;
-  float offPoint_y= -1.2f; 
+  // bounding box of the triangle, its corner is where the
+  // interpolated colors start so they don't depend on the clip
+  int x_origin= min(p0.x, min(p1.x, p2.x));
+  int y_origin= min(p0.y, min(p1.y, p2.y));
+  int x_min= max(x_origin, clip.x_min);
+  int x_max= min(max(p0.x, max(p1.x, p2.x)), clip.x_max);
+  int y_min= max(y_origin, clip.y_min);
+  int y_max= min(max(p0.y, max(p1.y, p2.y)), clip.y_max);
+  if (x_min > x_max || y_min > y_max) return;
+
+  // w0 is the edge opposite of p0 (so it weighs p0's color), etc.
+  // Moving one column adds dx to an edge function, one row adds dy
+  int dx0= p1.y - p2.y, dy0= p2.x - p1.x;
+  int dx1= p2.y - p0.y, dy1= p0.x - p2.x;
+  int dx2= p0.y - p1.y, dy2= p1.x - p0.x;
+
+  int e0= edgeFunction(p1, p2, x_origin, y_origin);
+  int e1= edgeFunction(p2, p0, x_origin, y_origin);
+  int e2= edgeFunction(p0, p1, x_origin, y_origin);
+
+  // the bias turns the >= 0 test into > 0 for edges that are not top-left
+  int x_skip= x_min - x_origin;
+  int y_skip= y_min - y_origin;
+  int w0_row= e0 + dx0*x_skip + dy0*y_skip + (isTopLeftEdge(p1, p2) ? 0 : -1);
+  int w1_row= e1 + dx1*x_skip + dy1*y_skip + (isTopLeftEdge(p2, p0) ? 0 : -1);
+  int w2_row= e2 + dx2*x_skip + dy2*y_skip + (isTopLeftEdge(p0, p1) ? 0 : -1);
+
+  // The interpolated color (w0*c0 + w1*c1 + w2*c2) / area is linear in x and y,
+  // so we step it in 16.16 fixed point. The half added to the start rounds
+  // to nearest and keeps the accumulated error from truncating a channel.
+  // Only these setup divisions are done, none inside the loop
+  const long long half= 1 << 15;
+  long long r_row= (((long long) e0*p0.color.r + (long long) e1*p1.color.r + 
+    (long long) e2*p2.color.r) * 65536) / area + half;
+  long long g_row= (((long long) e0*p0.color.g + (long long) e1*p1.color.g + 
+    (long long) e2*p2.color.g) * 65536) / area + half;
+  long long b_row= (((long long) e0*p0.color.b + (long long) e1*p1.color.b + 
+    (long long) e2*p2.color.b) * 65536) / area + half;
+
+  long long r_dx= ((long long) (dx0*p0.color.r + dx1*p1.color.r + dx2*p2.color.r) * 65536) / area;
+  long long g_dx= ((long long) (dx0*p0.color.g + dx1*p1.color.g + dx2*p2.color.g) * 65536) / area;
+  long long b_dx= ((long long) (dx0*p0.color.b + dx1*p1.color.b + dx2*p2.color.b) * 65536) / area;
+  long long r_dy= ((long long) (dy0*p0.color.r + dy1*p1.color.r + dy2*p2.color.r) * 65536) / area;
+  long long g_dy= ((long long) (dy0*p0.color.g + dy1*p1.color.g + dy2*p2.color.g) * 65536) / area;
+  long long b_dy= ((long long) (dy0*p0.color.b + dy1*p1.color.b + dy2*p2.color.b) * 65536) / area;
+
+  // jumping to the clipped corner lands on the same values as stepping there
+  r_row+= r_dx*x_skip + r_dy*y_skip;
+  g_row+= g_dx*x_skip + g_dy*y_skip;
+  b_row+= b_dx*x_skip + b_dy*y_skip;
 
   for (int y= y_min; y <= y_max; y++) {
-    for (int x= x_min; x <= x_max; x++) {
-      float alpha= this->implicitLineFn(p1.x, p1.y, p2.x, p2.y, (float) x, (float) y) / f_alpha;
-      float beta= this->implicitLineFn(p2.x, p2.y, p0.x, p0.y, (float) x, (float) y) / f_beta;
-      float gamma= this->implicitLineFn(p0.x, p0.y, p1.x, p1.y, (float) x, (float) y) / f_gamma;
-      if (alpha >= 0 && beta >= 0 && gamma >= 0) {
-        // this either checks if the point is inside the triangle or on an edge
-        // if it is an edge, we check it with the offscreen point to see if the
-        // edge should be part of this triangle
-        if ((alpha > 0 || f_alpha * this->implicitLineFn(p1.x, p1.y, p2.x, p2.y, offPoint_x, offPoint_y) > 0)
-        && (beta > 0 || f_beta * this->implicitLineFn(p2.x, p2.y, p0.x, p0.y, offPoint_x, offPoint_y) > 0)
-        && (gamma > 0 || f_gamma * this->implicitLineFn(p0.x, p0.y, p1.x, p1.y, offPoint_x, offPoint_y) > 0))
-        {
-          Pixel newColor= Pixel{0, 0, 0};
-          newColor.r= alpha * p0.color.r + beta * p1.color.r + gamma * p2.color.r;
-          newColor.g= alpha * p0.color.g + beta * p1.color.g + gamma * p2.color.g;
-          newColor.b= alpha * p0.color.b + beta * p1.color.b + gamma * p2.color.b;
-
-          this->_colorPixel(x, y, newColor);
-        }
+    int w0= w0_row;
+    int w1= w1_row;
+    int w2= w2_row;
+    long long r= r_row;
+    long long g= g_row;
+    long long b= b_row;
+    unsigned char* px= this->_pixelAddress(x_min, y);
+
+    for (int x= x_min; x <= x_max; x++, px+= PIXEL_BYTES) {
+      // inside when none of the (biased) edge functions is negative
+      if ((w0 | w1 | w2) >= 0) {
+        Pixel newColor {(unsigned char) (r >> 16), (unsigned char) (g >> 16),
+          (unsigned char) (b >> 16)};
+        blend.pixel(px, newColor);
       }
-
+      w0+= dx0;
+      w1+= dx1;
+      w2+= dx2;
+      r+= r_dx;
+      g+= g_dx;
+      b+= b_dx;
     }
-  } 
+
+    w0_row+= dy0;
+    w1_row+= dy1;
+    w2_row+= dy2;
+    r_row+= r_dy;
+    g_row+= g_dy;
+    b_row+= b_dy;
+  }
 }
 /* this only gets the outline
 void Canvas::drawCircle(const Point& p, int radius)
@@ -552,21 +1165,52 @@ void Canvas::drawCircle(const Point& p, int radius)
 
 void Canvas::drawCircle(const Point& p, int radius)
 {
-  int x_min= max(p.x - radius, 0);
-  int x_max= min(p.x + radius, this->_canvas.width()-1);
-  int y_min= max(p.y - radius, 0);
-  int y_max= min(p.y + radius, this->_canvas.height()-1);
+  ClipRect canvasRect= this->_canvasRect();
+  this->_preserveSnapshots(ClipRect {p.x - radius, p.y - radius, 
+    p.x + radius, p.y + radius});
+  withBlend(this->currentBlendType, this->currentAlpha, [&](const auto& blend) {
+    this->_drawCircle(blend, p, radius, canvasRect);
+  });
+}
 
-  for (int y= y_min; y <= y_max; y++) {
-    for (int x= x_min; x <= x_max; x++) {
-      int r_squared= radius * radius;
-      int x_y_squared= (x-p.x) * (x-p.x) + (y-p.y) * (y-p.y);
-      // check if x^2 + y^2 <= r^2 to be part of the circle
-
-      // I don't include equal because it creates a jagged scircle
-      if (x_y_squared < r_squared) {
-        this->_colorPixel(x, y, p.color);
-      }
+/**
+ * Fills the circle row by row. A pixel is inside when
+ * x^2 + y^2 < r^2 (I don't include equal because it creates
+ * a jagged circle), so the half width of row dy is the largest
+ * x with x^2 < r^2 - dy^2. Going from the middle row outwards
+ * the half width only shrinks, so we track it with the integer
+ * midpoint error d = r^2 - dy^2 - x^2 instead of a sqrt.
+*/
+template <class Blend>
+void Canvas::_drawCircle(const Blend& blend, const Point& p, int radius, 
+  const ClipRect& clip)
+{
+  if (radius <= 0) return;
+
+  int halfWidth= radius - 1;
+  int d= 2 * radius - 1; // r^2 - (r-1)^2
+
+  for (int dy= 0; dy < radius; dy++) {
+    if (dy > 0) d-= 2 * dy - 1; // dy^2 - (dy-1)^2
+
+    while (d <= 0 && halfWidth >= 0) {
+      d+= 2 * halfWidth - 1; // x^2 - (x-1)^2
+      halfWidth--;
+    }
+    if (halfWidth < 0) break;
+
+    int x0= max(p.x - halfWidth, clip.x_min);
+    int x1= min(p.x + halfWidth, clip.x_max);
+    if (x0 > x1) continue;
+
+    int y= p.y - dy;
+    if (y >= clip.y_min && y <= clip.y_max) {
+      blend.span(this->_pixelAddress(x0, y), x1 - x0 + 1, p.color);
+    }
+
+    y= p.y + dy;
+    if (dy > 0 && y >= clip.y_min && y <= clip.y_max) {
+      blend.span(this->_pixelAddress(x0, y), x1 - x0 + 1, p.color);
     }
   }
 }
@@ -593,9 +1237,59 @@ bool Canvas::polygonContainsPoint(std::vector<Point>& polygon, const Point& test
 }
 
 bool Canvas::collision(const Point& p1, int r1, const Point& p2, int r2) {
-  return pow(p2.x - p1.x, 2) + pow(p2.y - p1.y, 2) < pow(r1 + r2, 2);
+  int dx= p2.x - p1.x;
+  int dy= p2.y - p1.y;
+  int r= r1 + r2;
+  return dx*dx + dy*dy < r*r;
 }
 
+/**
+ * Uniform grid over the packing area that indexes the placed circles
+ * by the cell their center is in. Two circles can only collide if their
+ * centers are closer than the sum of their radii, so with cells at least
+ * that wide a candidate only needs to check the 3x3 cells around it.
+*/
+struct CircleGrid {
+  int x_min;
+  int y_min;
+  int cellSize;
+  int nCols;
+  int nRows;
+  std::vector<std::vector<int>> cells; // indexes into the placed circles
+
+  CircleGrid(int x_min, int y_min, int x_max, int y_max, int cellSize) :
+    x_min(x_min), y_min(y_min), cellSize(cellSize),
+    nCols((x_max - x_min) / cellSize + 1), nRows((y_max - y_min) / cellSize + 1),
+    cells(nCols * nRows) {}
+
+  int column(int x) const {
+    return clamp((x - this->x_min) / this->cellSize, 0, this->nCols - 1);
+  }
+
+  int row(int y) const {
+    return clamp((y - this->y_min) / this->cellSize, 0, this->nRows - 1);
+  }
+
+  void insert(const Point& p, int i) {
+    this->cells[this->row(p.y) * this->nCols + this->column(p.x)].push_back(i);
+  }
+
+  // Returns whether the circle collides with any of the placed ones
+  bool collides(const Point& p, int radius, 
+    const std::vector<Point>& locations, const std::vector<int>& radii) const {
+    int col= this->column(p.x);
+    int row= this->row(p.y);
+    for (int y= max(row - 1, 0); y <= min(row + 1, this->nRows - 1); y++) {
+      for (int x= max(col - 1, 0); x <= min(col + 1, this->nCols - 1); x++) {
+        for (int i: this->cells[y * this->nCols + x]) {
+          if (Canvas::collision(p, radius, locations[i], radii[i])) return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
 
 void Canvas::packCircles(std::vector<Point>& polygon, std::vector<Pixel>& palette) {
   srand(time(0));
@@ -619,6 +1313,10 @@ void Canvas::packCircles(std::vector<Point>& polygon, std::vector<Pixel>& palett
   std::vector<Point> locations;
   std::vector<int> radii;
 
+  // radii are below max_radius, so colliding centers are
+  // less than 2 * max_radius apart
+  CircleGrid grid(x_min, y_min, x_max, y_max, 2 * max_radius);
+
   // current point information
   Point p;
   Pixel cur_color;
@@ -671,14 +1369,9 @@ void Canvas::packCircles(std::vector<Point>& polygon, std::vector<Pixel>& palett
 
       // after passing the loop, we now try to place it on the canvas
       // but we also need to check if it collides with any other circle
-      int numExistingCircles= locations.size();
-      bool doesCollide= false;
-      for (int i= 0; i < numExistingCircles; i++) {
-        doesCollide= doesCollide || Canvas::collision(p, cur_radius, locations[i], radii[i]);
-        if (doesCollide) {
-          num_collisions++;
-          break;
-        }
+      bool doesCollide= grid.collides(p, cur_radius, locations, radii);
+      if (doesCollide) {
+        num_collisions++;
       }
 
       // after all the checks, we finally draw it and add it to the existing
@@ -687,6 +1380,7 @@ void Canvas::packCircles(std::vector<Point>& polygon, std::vector<Pixel>& palett
         placed= true;
         p.color= cur_color;
         drawCircle(p, cur_radius);
+        grid.insert(p, locations.size());
         locations.push_back(p);
         radii.push_back(cur_radius);
       }
@@ -697,54 +1391,147 @@ void Canvas::packCircles(std::vector<Point>& polygon, std::vector<Pixel>& palett
 }
 
 void Canvas::drawRose(const Point& p, int radius, int numPetals) {
-  const int NUM_POINTS= 100;
-  float deltaTheta= 2*M_PI/NUM_POINTS;
-  int xOffset= p.x;
-  int yOffset= p.y;
-
-  for (float theta= 0.0f; theta < 2 * M_PI; theta+= deltaTheta) {
-    float r_cur= radius * cos(theta*numPetals);
-    float r_next= radius * cos((theta+deltaTheta)*numPetals);
+  VertexBuffer segments;
+  this->_roseSegments(p, radius, numPetals, segments);
+  ClipRect canvasRect= this->_canvasRect();
+  this->_preserveSnapshots(canvasRect);
+  withBlend(this->currentBlendType, this->currentAlpha, [&](const auto& blend) {
+    for (int i= 0; i < segments.size(); i+=2) {
+      this->_drawLine(blend, segments.point(i), segments.point(i+1), canvasRect);
+    }
+  });
+}
 
-    Point p1 {xOffset + (int) (r_cur * cos(theta)), yOffset + 
-    (int) (r_cur * sin(theta)), p.color};
-    Point p2 {xOffset + (int) (r_next * cos(theta + deltaTheta)), 
-      yOffset + (int) (r_next * sin(theta + deltaTheta)),
-      p.color};
+/**
+ * Roses with the same number of petals and points share one polyline
+ * of the rose with radius 1, so drawing a rose only scales and moves
+ * the template. Small roses use fewer points, roughly one every few
+ * pixels along the curve, up to MAX_ROSE_POINTS.
+*/
+int roseTessellation(int radius, int numPetals)
+{
+  int numPoints= (int) ceil(M_PI * std::abs(radius) * (std::abs(numPetals) + 1));
+  return clamp(numPoints, MIN_ROSE_POINTS, MAX_ROSE_POINTS);
+}
 
-    this->drawLine(p1, p2);
+const std::vector<float>& Canvas::_roseTemplate(int numPetals, int numPoints) {
+  std::vector<float>& unitRose= this->roseTemplates[std::make_pair(numPetals, numPoints)];
+  if (!unitRose.empty()) return unitRose;
+
+  // the last point closes the curve back at theta = 2 pi
+  unitRose.resize(2 * (numPoints + 1));
+  float deltaTheta= 2*M_PI/numPoints;
+  for (int i= 0; i <= numPoints; i++) {
+    float theta= i * deltaTheta;
+    float r= cos(theta*numPetals);
+    unitRose[2*i]= r * cos(theta);
+    unitRose[2*i + 1]= r * sin(theta);
   }
+  return unitRose;
 }
 
-void Canvas::drawFlow(Point& p) {
-  
-  Point p1= p;
-  Point p2= p;
-  
-  for (int i= 0; i < this->flowField.numSteps; i++) {
-    p1= p2;
+void Canvas::_roseSegments(const Point& p, int radius, int numPetals, 
+  VertexBuffer& segments) {
+  int numPoints= roseTessellation(radius, numPetals);
+  const std::vector<float>& unitRose= this->_roseTemplate(numPetals, numPoints);
+  int xOffset= p.x;
+  int yOffset= p.y;
 
-    // offset for the angle flow field
-    int x_offset= p1.x - this->flowField.min_x;
-    int y_offset= p1.y - this->flowField.min_y;
+  Point p1 {xOffset + (int) (radius * unitRose[0]), 
+    yOffset + (int) (radius * unitRose[1]), p.color};
+  for (int i= 1; i <= numPoints; i++) {
+    Point p2 {xOffset + (int) (radius * unitRose[2*i]), 
+      yOffset + (int) (radius * unitRose[2*i + 1]), p.color};
 
-    // get the indexes using ratios
-    int x_flow_idx= (int) (x_offset / this->flowField.resolution);
-    int y_flow_idx= (int) (y_offset / this->flowField.resolution);
+    segments.push(p1);
+    segments.push(p2);
+    p1= p2;
+  }
+}
 
-    
-    // get the angle and clamp the idx
-    float angle= this->flowField.field[clamp(y_flow_idx * 
-      this->flowField.nCols + x_flow_idx, 0,
-      this->flowField.nCols * this->flowField.nRows - 1)];
+void Canvas::drawFlow(Point& p) {
+  VertexBuffer seeds;
+  seeds.push(p);
+  this->_drawFlows(seeds);
+}
 
+/**
+ * Integrates the flows of a batch of seeds in lockstep. The positions
+ * are kept as a structure of arrays, one row of x and y values per step,
+ * so finding the field cells and taking the steps are plain loops over
+ * arrays. Only looking up the directions (which may generate a tile)
+ * goes seed by seed. Each batch is drawn before the next one is
+ * integrated, its segments flow by flow, in the same order drawing each
+ * flow on its own would draw them.
+*/
+void Canvas::_drawFlows(const VertexBuffer& seeds) {
+  const FlowField& field= this->flowField;
+  int numSteps= field.numSteps;
+  if (numSteps <= 0 || seeds.size() == 0) return;
+
+  int lastCell= field.nCols * field.nRows - 1;
+  float stepLength= field.stepLength;
+  VertexBuffer segments;
+
+  // path_x[s * n + i] is the x position of seed i after s steps
+  std::vector<int> path_x;
+  std::vector<int> path_y;
+  std::vector<int> cells;
+  std::vector<float> dir_x;
+  std::vector<float> dir_y;
+
+  for (int start= 0; start < seeds.size(); start+= FLOW_BATCH_SIZE) {
+    int n= min((int) seeds.size() - start, FLOW_BATCH_SIZE);
+    path_x.resize((numSteps + 1) * n);
+    path_y.resize((numSteps + 1) * n);
+    cells.resize(n);
+    dir_x.resize(n);
+    dir_y.resize(n);
+
+    std::copy(&seeds.x[start], &seeds.x[start] + n, path_x.begin());
+    std::copy(&seeds.y[start], &seeds.y[start] + n, path_y.begin());
+
+    for (int step= 0; step < numSteps; step++) {
+      const int* x= &path_x[step * n];
+      const int* y= &path_y[step * n];
+      int* next_x= &path_x[(step + 1) * n];
+      int* next_y= &path_y[(step + 1) * n];
+
+      // get the field indexes using ratios and clamp them
+      for (int i= 0; i < n; i++) {
+        int x_flow_idx= (x[i] - field.min_x) / field.resolution;
+        int y_flow_idx= (y[i] - field.min_y) / field.resolution;
+        cells[i]= min(max(y_flow_idx * field.nCols + x_flow_idx, 0), lastCell);
+      }
 
-    int x_step= this->flowField.stepLength * cos(angle);
-    int y_step= this->flowField.stepLength * sin(angle);
+      for (int i= 0; i < n; i++) {
+        const float* direction= this->_flowDirection(cells[i]);
+        dir_x[i]= direction[0];
+        dir_y[i]= direction[1];
+      }
 
-    p2= Point {p1.x + x_step, p1.y + y_step, p1.color};
+      for (int i= 0; i < n; i++) {
+        next_x[i]= x[i] + (int) (stepLength * dir_x[i]);
+        next_y[i]= y[i] + (int) (stepLength * dir_y[i]);
+      }
+    }
 
-    this->drawLine(p1, p2);
+    segments.x.resize(2 * n * numSteps);
+    segments.y.resize(2 * n * numSteps);
+    segments.color.resize(2 * n * numSteps);
+    int* x= &segments.x[0];
+    int* y= &segments.y[0];
+    Pixel* color= &segments.color[0];
+    for (int i= 0; i < n; i++) {
+      for (int step= 0; step < numSteps; step++) {
+        *x++= path_x[step * n + i];
+        *y++= path_y[step * n + i];
+        *x++= path_x[(step + 1) * n + i];
+        *y++= path_y[(step + 1) * n + i];
+      }
+      std::fill(color, color + 2 * numSteps, seeds.color[start + i]);
+      color+= 2 * numSteps;
+    }
+    this->_rasterize(LINES, segments);
   }
-
-}
\ No newline at end of file
+}
@@ -11,12 +11,18 @@
 #ifndef canvas_H_
 #define canvas_H_
 
+#include <future>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include "image.h"
 
 namespace agl
 {
+  class CanvasSnapshot;
+
   enum BlendType { ALPHA, ADD, REPLACE };
 
   enum PrimitiveType {UNDEFINED, LINES, TRIANGLES, CIRCLES, ROSES, FLOW, POLYGON};
@@ -27,8 +33,47 @@ namespace agl
     Pixel color;
   };
 
+  // Vertices kept as a structure of arrays
+  struct VertexBuffer {
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<Pixel> color;
+    std::vector<int> radius;  // only filled for CIRCLES and ROSES
+    std::vector<int> petals;  // only filled for ROSES
+
+    int size() const;
+    Point point(int i) const;
+
+    // Appends a vertex that has no radius or petals
+    void push(const Point& p);
+
+    // Reserves room for n positions and colors
+    void reserve(size_t n);
+    void clear();
+  };
+
+  // Inclusive pixel bounds that rasterization is limited to
+  struct ClipRect {
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+  };
+
+  // Side length (in field cells) of the square tiles of a flow field
+  const int FLOW_TILE_SIZE= 64;
+
   struct FlowField {
-    std::vector<float> field;
+    // The unit vectors (cos, sin) of the angles are generated lazily one
+    // FLOW_TILE_SIZE x FLOW_TILE_SIZE tile at a time, a tile is empty
+    // until it is first looked up
+    std::vector<std::vector<float>> tiles;
+    int nTileRows;
+    int nTileCols;
+    double scale;       // noise units per field cell
+    unsigned seed;      // 0 is the original field
+    std::string cacheDirectory; // empty if the field is not cached on disk
+    bool cacheChecked;  // whether we already tried to load the cache
     int resolution;
     int min_x;
     int max_x;
@@ -44,11 +89,18 @@ namespace agl
   {
   public:
     Canvas(int w, int h);
+    // Waits for the saves saveAsync started
     virtual ~Canvas();
 
     // Save to file
     void save(const std::string& filename);
 
+    // Save the canvas as it is now to file on a background thread, the
+    // future tells whether it worked. The canvas isn't copied up front,
+    // drawing copies the tiles it is about to change and the save copies
+    // the rest. Blocks while the queue of saves is full
+    std::shared_future<bool> saveAsync(const std::string& filename);
+
     // Draw primitives with a given type (either LINES or TRIANGLES)
     // For example, the following draws a red line followed by a green line
     // begin(LINES);
@@ -63,12 +115,22 @@ namespace agl
 
     // This will draw the shapes, then clear the vectors, and reset
     // the primitive type back to UNDEFINED and blendType back to REPLACE
+    // Lines, triangles, circles, roses and flows are binned into screen
+    // tiles that are rasterized in parallel, keeping submission order
+    // within each tile so blending matches drawing them one at a time
     void end();
 
     // Specify a vertex at raster position (x,y)
     // x corresponds to the column; y to the row
     void vertex(int x, int y);
 
+    // Specify n vertices at once, the same as calling
+    // vertex(xs[i], ys[i]) for each of them
+    void vertices(const int* xs, const int* ys, size_t n);
+
+    // Make room for n more vertices before specifying them
+    void reserve(size_t n);
+
     // Specify the alpha for alpha blending
     void alpha(float alpha);
 
@@ -97,25 +159,24 @@ namespace agl
     // Specify a flow field's stepLength
     void stepLength(int length);
 
-    // Bresenham's line algorithm
+    // Specify the seed of the flow field's noise, which regenerates it
+    void flowSeed(unsigned seed);
+
+    // Cache the flow field in the given directory. The first render that
+    // uses FLOW writes the whole field there, and later canvases with the
+    // same dimensions, resolution, scale and seed load it instead
+    void flowCache(const std::string& directory);
+
+    // Bresenham's line algorithm, the part of the line
+    // that is on the canvas gets drawn
     void drawLine(Point& p1, Point& p2);
 
     // Draws a triangle from three points, this might
     // change the parameters (which will be cleared anyway if drawn)
+    // Uses integer edge functions stepped per row and column with
+    // the top-left fill rule, so shared edges are only drawn once
     void drawTriangle(Point& p0, Point& p1, Point& p2);
 
-    // Interpolates pixel colors with a given alpha
-    static Pixel interpolateColor(const Pixel& p1, const Pixel& p2, float alpha);
-
-    /* Computes if the otherPt is on the same line as the two points or not.
-      * Returns a positive number if the otherPt is above the line
-      * and a negative number if the otherPt is below the line.
-      * I chose to do it in this style, so it can take offscreen floating points
-    */
-    static float implicitLineFn(float linePt1_x, float linePt1_y, 
-      float linePt2_x, float linePt2_y, 
-      float otherPt_x, float otherPt_y);
-
     /**
      * Finds the box that bounds the vector of given points.
      * The values will be returned in the passed references.
@@ -124,14 +185,7 @@ namespace agl
       int& x_min, int& y_min, int& x_max, int& y_max);
 
     /**
-     * This method rearranges the points, so that
-     * p0 -> p1 -> p2 goes in CCW orientation.
-     * 
-    */
-    static void rearrangeCCW(Point& p0, Point& p1, Point& p2);
-
-    /**
-     * Draws a circle at point p
+     * Draws a circle at point p, one span per row
     */
     void drawCircle(const Point& p, int radius);
 
@@ -167,27 +221,90 @@ namespace agl
   private:
     // Helper functions for drawLine, so that they can 
     // use _canvas without passing it as a parameter
-    void _drawLineLow(const Point& p1, const Point& p2);
-    void _drawLineHigh(const Point& p1, const Point& p2);
-
-    // This will color the pixel at x and y
-    // based on the blend type
-    void _colorPixel(int x, int y, const Pixel& p);
+    template <class Blend>
+    void _drawLineLow(const Blend& blend, const Point& p1, const Point& p2, 
+      const ClipRect& clip);
+    template <class Blend>
+    void _drawLineHigh(const Blend& blend, const Point& p1, const Point& p2, 
+      const ClipRect& clip);
+
+    // The rasterizers behind the public draw methods, they only
+    // touch the pixels inside clip. Blend is one of the blend
+    // policies in canvas.cpp, so each blend type gets its own loops
+    template <class Blend>
+    void _drawLine(const Blend& blend, const Point& p1, const Point& p2, 
+      const ClipRect& clip);
+    template <class Blend>
+    void _drawTriangle(const Blend& blend, Point p0, Point p1, Point p2, 
+      const ClipRect& clip);
+    template <class Blend>
+    void _drawCircle(const Blend& blend, const Point& p, int radius, 
+      const ClipRect& clip);
+
+    // Appends the line segments (pairs of points) of a rose
+    void _roseSegments(const Point& p, int radius, int numPetals, 
+      VertexBuffer& segments);
+
+    // Draws the flows starting at each seed, FLOW_BATCH_SIZE seeds at a time
+    void _drawFlows(const VertexBuffer& seeds);
+
+    // Draws every primitive of the given type (LINES, TRIANGLES or CIRCLES)
+    // from the vertices, binning them into tiles
+    void _rasterize(PrimitiveType type, const VertexBuffer& vertices);
+    template <class Blend>
+    void _rasterizeTiles(const Blend& blend, PrimitiveType type, 
+      const VertexBuffer& vertices);
+
+    // Draws the i-th primitive of the vertices inside clip
+    template <class Blend>
+    void _rasterPrimitive(const Blend& blend, PrimitiveType type, 
+      const VertexBuffer& vertices, int i, const ClipRect& clip);
+
+    // Returns the cached polyline (x, y pairs) of a rose with radius 1
+    const std::vector<float>& _roseTemplate(int numPetals, int numPoints);
+
+    // Returns the canvas as a clip rectangle
+    ClipRect _canvasRect() const;
+
+    // Returns the address of the canvas bytes of pixel (x, y)
+    unsigned char* _pixelAddress(int x, int y);
+
+    // Returns the flow field direction (cos, sin) at the given cell
+    // index, generating its tile first if needed
+    const float* _flowDirection(int idx);
+
+    // Fills in the directions of one flow field tile
+    void _generateFlowTile(int tile);
+
+    // The file the flow field is cached in
+    std::string _flowCacheFile() const;
+
+    // Read or write every tile of the flow field from the cache file
+    bool _loadFlowCache();
+    bool _saveFlowCache();
+
+    // Has the snapshots of pending saves copy the tiles that overlap
+    // rect, every draw calls it before writing there
+    void _preserveSnapshots(const ClipRect& rect);
 
 
 
     Image _canvas;
     PrimitiveType currentPrimitiveType= UNDEFINED;
     Pixel currentColor;
-    std::vector<Point> myPoints;
-    std::vector<int> myRadii;     // determines the radius of circle points
-    std::vector<int> myNumPetals; // determines number of petals
+    VertexBuffer myVertices;
     std::vector<Pixel> myPalette;   // palette for packing circles
     FlowField flowField;
+    // unit rose polylines keyed by (numPetals, numPoints)
+    std::map<std::pair<int, int>, std::vector<float>> roseTemplates;
     BlendType currentBlendType= REPLACE;
     int currentRadius= 1;
     int currentNumPetals= 1; // for rose curve
     float currentAlpha= 0.0f;
+    // snapshots of saves that may still need tiles of the canvas, the
+    // save owns each one and frees it when done
+    std::vector<std::weak_ptr<CanvasSnapshot>> mySnapshots;
+    std::vector<std::shared_future<bool>> myPendingSaves;
 
   };
 }
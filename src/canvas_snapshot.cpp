@@ -0,0 +1,87 @@
+#include "canvas_snapshot.h"
+#include "image_pool.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace agl;
+
+/**
+ * The snapshot gets its own buffer up front, but no pixels are copied
+ * when it is taken. Each tile is copied once, either by whoever draws
+ * over it first, or by the thread that reads the snapshot, which takes
+ * the tiles one at a time so drawing never waits for more than one.
+ * Both hold the same lock while checking and copying a tile, so a tile
+ * is always copied before it is drawn over.
+*/
+
+const int CHANNELS= 3;
+
+CanvasSnapshot::CanvasSnapshot(const unsigned char* pixels, int width, int height,
+  int tileSize) :
+  mySource(pixels), myWidth(width), myHeight(height), myTileSize(tileSize)
+{
+  this->myTilesX= (width + tileSize - 1) / tileSize;
+  this->myTilesY= (height + tileSize - 1) / tileSize;
+  this->myCopied.assign(this->myTilesX * this->myTilesY, false);
+  this->myRemaining= this->myTilesX * this->myTilesY;
+  this->myData= ImagePool::shared().acquire(width, height);
+}
+
+CanvasSnapshot::~CanvasSnapshot()
+{
+  ImagePool::shared().release(this->myData, this->myWidth, this->myHeight);
+}
+
+void CanvasSnapshot::_copyTile(int t)
+{
+  if (this->myCopied[t]) return;
+
+  int x= (t % this->myTilesX) * this->myTileSize;
+  int y= (t / this->myTilesX) * this->myTileSize;
+  int rowBytes= this->myWidth * CHANNELS;
+  int tileBytes= (std::min(x + this->myTileSize, this->myWidth) - x) * CHANNELS;
+  int yEnd= std::min(y + this->myTileSize, this->myHeight);
+  for (; y < yEnd; y++) {
+    size_t offset= (size_t) y * rowBytes + x * CHANNELS;
+    std::memcpy(this->myData + offset, this->mySource + offset, tileBytes);
+  }
+  this->myCopied[t]= true;
+  this->myRemaining--;
+}
+
+void CanvasSnapshot::preserve(int x_min, int y_min, int x_max, int y_max)
+{
+  if (this->myRemaining == 0) return;
+
+  x_min= std::max(x_min, 0);
+  y_min= std::max(y_min, 0);
+  x_max= std::min(x_max, this->myWidth - 1);
+  y_max= std::min(y_max, this->myHeight - 1);
+  if (x_min > x_max || y_min > y_max) return;
+
+  x_min/= this->myTileSize;
+  y_min/= this->myTileSize;
+  x_max/= this->myTileSize;
+  y_max/= this->myTileSize;
+
+  std::lock_guard<std::mutex> lock(this->myMutex);
+  for (int ty= y_min; ty <= y_max; ty++) {
+    for (int tx= x_min; tx <= x_max; tx++) {
+      this->_copyTile(ty * this->myTilesX + tx);
+    }
+  }
+}
+
+const unsigned char* CanvasSnapshot::pixels()
+{
+  for (int t= 0; t < this->myTilesX * this->myTilesY && this->myRemaining > 0; t++) {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    this->_copyTile(t);
+  }
+  return this->myData;
+}
+
+bool CanvasSnapshot::complete() const
+{
+  return this->myRemaining == 0;
+}
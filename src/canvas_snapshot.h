@@ -0,0 +1,61 @@
+/*-----------------------------------------------
+ * Description: A copy-on-write snapshot of an RGB
+ * image. The snapshot starts out sharing every
+ * tile with the image, a tile is only copied when
+ * something is about to draw over it, or by the
+ * thread that reads the snapshot.
+ ----------------------------------------------*/
+
+#ifndef canvas_snapshot_H_
+#define canvas_snapshot_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace agl
+{
+  class CanvasSnapshot
+  {
+  public:
+    // A snapshot of the width x height RGB pixels as they are now. They
+    // must stay put, and every write to them must be preceded by
+    // preserve(), until complete() is true
+    CanvasSnapshot(const unsigned char* pixels, int width, int height, int tileSize);
+    virtual ~CanvasSnapshot();
+
+    CanvasSnapshot(const CanvasSnapshot&)= delete;
+    CanvasSnapshot& operator=(const CanvasSnapshot&)= delete;
+
+    // Copies the tiles that overlap the inclusive pixel bounds and are
+    // still shared, call it before drawing there
+    void preserve(int x_min, int y_min, int x_max, int y_max);
+
+    // Copies every tile that is still shared and returns the snapshot
+    // pixels, after which the image is free to change and be destroyed
+    const unsigned char* pixels();
+
+    // Whether no tile is shared anymore
+    bool complete() const;
+
+    int width() const { return myWidth; }
+    int height() const { return myHeight; }
+
+  private:
+    // Copies tile t if it is still shared, with myMutex held
+    void _copyTile(int t);
+
+    const unsigned char* mySource;
+    unsigned char* myData;
+    int myWidth;
+    int myHeight;
+    int myTileSize;
+    int myTilesX;
+    int myTilesY;
+    std::mutex myMutex;             // guards myCopied
+    std::vector<bool> myCopied;
+    std::atomic<int> myRemaining;   // tiles not copied yet
+  };
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*-----------------------------------------------
+ * Description: 256 entry lookup tables, one per
+ * channel, for tone curves. Curves added to a
+ * ChannelLUT compose into its tables, so a whole
+ * chain of them costs one lookup per byte.
+ ----------------------------------------------*/
+
+#ifndef channel_lut_H_
+#define channel_lut_H_
+
+namespace agl
+{
+  class ChannelLUT
+  {
+  public:
+    // Every curve takes a channel (0 red, 1 green, 2 blue) or ALL_CHANNELS
+    static const int ALL_CHANNELS= -1;
+
+    // Starts out as the identity
+    ChannelLUT();
+
+    // v becomes 255 * (v / 255)^(1 / gamma), as in Image::gammaCorrect
+    ChannelLUT& gamma(float gamma, int channel = ALL_CHANNELS);
+
+    // v becomes 255 - v
+    ChannelLUT& invert(int channel = ALL_CHANNELS);
+
+    // Maps [inLow, inHigh] onto [outLow, outHigh] with a gamma curve in
+    // between, values outside the input range clamp to its ends
+    ChannelLUT& levels(int inLow, int inHigh, int outLow, int outHigh,
+      float gamma = 1.0f, int channel = ALL_CHANNELS);
+
+    // v becomes min(max(v, low), high)
+    ChannelLUT& clamp(int low, int high, int channel = ALL_CHANNELS);
+
+    // the channel becomes 0
+    ChannelLUT& zero(int channel);
+
+    // Applies other's curves after the ones already here
+    ChannelLUT& then(const ChannelLUT& other);
+
+    // The table of a channel, indexed by the input value
+    const unsigned char* table(int channel) const { return myTables[channel]; }
+
+    // Maps numPixels RGB pixels from in to out, which may be the same
+    void apply(const unsigned char* in, unsigned char* out, int numPixels) const;
+
+    // Maps a width x height RGB image, a band of rows per task on the
+    // shared thread pool
+    void apply(const unsigned char* in, unsigned char* out,
+      int width, int height) const;
+
+  private:
+    // Replaces each entry v of the chosen channels with curve(v)
+    template <class Curve>
+    ChannelLUT& _compose(int channel, const Curve& curve);
+
+    unsigned char myTables[3][256];
+  };
+}
+
+#endif
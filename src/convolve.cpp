@@ -0,0 +1,282 @@
+#include "convolve.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AGL_CONVOLVE_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AGL_TARGET_AVX2
+#else
+#define AGL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace agl;
+
+/**
+ * The image is convolved as a stream of bytes: the taps of a byte are
+ * the bytes of the same channel in the neighbouring pixels, so within
+ * a row they sit a multiple of 3 bytes to either side. Rows far enough
+ * from the borders go through a row function (scalar, SSE2 or AVX2)
+ * that never clamps, only the border strips look up clamped pixels.
+ * The SIMD versions widen the bytes to 16 bits and sum two taps at a
+ * time with madd into 32 bit lanes, so every version does the same
+ * integer arithmetic.
+*/
+
+const int CHANNELS= 3;
+
+// Computes the bytes [begin, end) of one output row. taps[t] points at
+// the row of tap t, already moved by the tap's horizontal offset, and
+// pairs[t/2] holds the weights of taps t and t+1 in its two halves
+typedef void (*RowFunction)(const unsigned char* const* taps, 
+  const int16_t* weights, const int32_t* pairs, int numTaps, int shift, 
+  unsigned char* out, int begin, int end);
+
+inline unsigned char fixedToByte(int32_t sum, int shift)
+{
+  return (unsigned char) std::min(std::max(sum >> shift, 0), 255);
+}
+
+bool agl::makeFixedKernel(const int kernel[], float scale, int side, 
+  FixedKernel& fixed)
+{
+  if (side <= 0 || scale == 0) return false;
+
+  for (int shift= 0; shift <= 16; shift++) {
+    float numerator= std::ldexp(scale, shift);
+    if (numerator != std::floor(numerator)) continue;
+
+    int taps= side * side;
+    fixed.weights.assign(taps, 0);
+    int64_t largestSum= 0;
+    for (int t= 0; t < taps; t++) {
+      // convolution multiplies the pixel at (ky, kx) by the mirrored entry
+      int64_t weight= (int64_t) kernel[taps - 1 - t] * (int64_t) numerator;
+      if (weight < INT16_MIN || weight > INT16_MAX) return false;
+      fixed.weights[t]= (int16_t) weight;
+      largestSum+= std::abs(weight) * 255;
+    }
+    if (largestSum > INT32_MAX) return false;
+
+    fixed.side= side;
+    fixed.shift= shift;
+    return true;
+  }
+  return false;
+}
+
+// One output byte at (x, y, c), with the taps clamped to the image
+unsigned char convolveClamped(const unsigned char* src, int width, int height, 
+  const FixedKernel& kernel, int x, int y, int c)
+{
+  int radius= kernel.side / 2;
+  const int16_t* weight= kernel.weights.data();
+  int32_t sum= 0;
+  for (int ky= 0; ky < kernel.side; ky++) {
+    const unsigned char* row= src + 
+      std::min(std::max(y + ky - radius, 0), height - 1) * width * CHANNELS;
+    for (int kx= 0; kx < kernel.side; kx++) {
+      int px= std::min(std::max(x + kx - radius, 0), width - 1);
+      sum+= *weight++ * row[px * CHANNELS + c];
+    }
+  }
+  return fixedToByte(sum, kernel.shift);
+}
+
+// The pixels [x0, x1) of output row y, all clamped
+void convolveClampedPixels(const unsigned char* src, unsigned char* out, 
+  int width, int height, const FixedKernel& kernel, int y, int x0, int x1)
+{
+  for (int x= x0; x < x1; x++) {
+    for (int c= 0; c < CHANNELS; c++) {
+      out[x * CHANNELS + c]= convolveClamped(src, width, height, kernel, x, y, c);
+    }
+  }
+}
+
+// Only the SIMD versions use the weight pairs
+void convolveRowScalar(const unsigned char* const* taps, const int16_t* weights, 
+  const int32_t* /* pairs */, int numTaps, int shift, unsigned char* out, 
+  int begin, int end)
+{
+  for (int i= begin; i < end; i++) {
+    int32_t sum= 0;
+    for (int t= 0; t < numTaps; t++) {
+      sum+= weights[t] * taps[t][i];
+    }
+    out[i]= fixedToByte(sum, shift);
+  }
+}
+
+#if defined(AGL_CONVOLVE_SSE2)
+void convolveRowSSE2(const unsigned char* const* taps, const int16_t* weights, 
+  const int32_t* pairs, int numTaps, int shift, unsigned char* out, 
+  int begin, int end)
+{
+  const __m128i zero= _mm_setzero_si128();
+  const __m128i shiftBy= _mm_cvtsi32_si128(shift);
+  int i= begin;
+  for (; i + 16 <= end; i+= 16) {
+    __m128i acc0= zero, acc1= zero, acc2= zero, acc3= zero;
+    for (int t= 0; t < numTaps; t+= 2) {
+      __m128i a= _mm_loadu_si128((const __m128i*) (taps[t] + i));
+      __m128i b= _mm_loadu_si128((const __m128i*) (taps[t+1] + i));
+      __m128i aLow= _mm_unpacklo_epi8(a, zero), aHigh= _mm_unpackhi_epi8(a, zero);
+      __m128i bLow= _mm_unpacklo_epi8(b, zero), bHigh= _mm_unpackhi_epi8(b, zero);
+      __m128i w= _mm_set1_epi32(pairs[t/2]);
+      acc0= _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), w));
+      acc1= _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), w));
+      acc2= _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), w));
+      acc3= _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), w));
+    }
+    // the saturating packs clamp to [0, 255] like fixedToByte
+    __m128i low= _mm_packs_epi32(_mm_sra_epi32(acc0, shiftBy), _mm_sra_epi32(acc1, shiftBy));
+    __m128i high= _mm_packs_epi32(_mm_sra_epi32(acc2, shiftBy), _mm_sra_epi32(acc3, shiftBy));
+    _mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(low, high));
+  }
+  convolveRowScalar(taps, weights, pairs, numTaps, shift, out, i, end);
+}
+
+// Same as the SSE2 version on 32 bytes. The unpacks and packs all work
+// within 128 bit lanes, so the bytes come back out in order
+AGL_TARGET_AVX2
+void convolveRowAVX2(const unsigned char* const* taps, const int16_t* weights, 
+  const int32_t* pairs, int numTaps, int shift, unsigned char* out, 
+  int begin, int end)
+{
+  const __m256i zero= _mm256_setzero_si256();
+  const __m128i shiftBy= _mm_cvtsi32_si128(shift);
+  int i= begin;
+  for (; i + 32 <= end; i+= 32) {
+    __m256i acc0= zero, acc1= zero, acc2= zero, acc3= zero;
+    for (int t= 0; t < numTaps; t+= 2) {
+      __m256i a= _mm256_loadu_si256((const __m256i*) (taps[t] + i));
+      __m256i b= _mm256_loadu_si256((const __m256i*) (taps[t+1] + i));
+      __m256i aLow= _mm256_unpacklo_epi8(a, zero), aHigh= _mm256_unpackhi_epi8(a, zero);
+      __m256i bLow= _mm256_unpacklo_epi8(b, zero), bHigh= _mm256_unpackhi_epi8(b, zero);
+      __m256i w= _mm256_set1_epi32(pairs[t/2]);
+      acc0= _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(aLow, bLow), w));
+      acc1= _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(aLow, bLow), w));
+      acc2= _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(aHigh, bHigh), w));
+      acc3= _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(aHigh, bHigh), w));
+    }
+    __m256i low= _mm256_packs_epi32(_mm256_sra_epi32(acc0, shiftBy), _mm256_sra_epi32(acc1, shiftBy));
+    __m256i high= _mm256_packs_epi32(_mm256_sra_epi32(acc2, shiftBy), _mm256_sra_epi32(acc3, shiftBy));
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_packus_epi16(low, high));
+  }
+  convolveRowSSE2(taps, weights, pairs, numTaps, shift, out, i, end);
+}
+
+bool cpuHasAVX2()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return false;
+  __cpuid(info, 1);
+  bool osSavesAVX= (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && 
+    (_xgetbv(0) & 6) == 6;
+  if (!osSavesAVX) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Picks the row function once, from what the CPU supports
+RowFunction bestRowFunction()
+{
+#if defined(AGL_CONVOLVE_SSE2)
+  static const RowFunction best= cpuHasAVX2() ? convolveRowAVX2 : convolveRowSSE2;
+  return best;
+#else
+  return convolveRowScalar;
+#endif
+}
+
+// Packs an even number of weights two to an int, as the row functions take them
+std::vector<int32_t> weightPairs(const std::vector<int16_t>& weights)
+{
+  std::vector<int32_t> pairs(weights.size() / 2);
+  for (int p= 0; p < (int) pairs.size(); p++) {
+    pairs[p]= (uint16_t) weights[2*p] | ((uint32_t) (uint16_t) weights[2*p + 1] << 16);
+  }
+  return pairs;
+}
+
+// Convolves the rows [yBegin, yEnd) of dst
+void convolveWith(RowFunction rowFunction, const unsigned char* src, 
+  unsigned char* dst, int width, int height, const FixedKernel& kernel, 
+  int yBegin, int yEnd)
+{
+  const int rowBytes= width * CHANNELS;
+  const int radius= kernel.side / 2;
+  const int border= radius * CHANNELS;
+
+  // the SIMD versions take taps two at a time, so pad with a zero weight
+  int numTaps= kernel.weights.size();
+  std::vector<int16_t> weights(kernel.weights);
+  if (numTaps % 2 != 0) weights.push_back(0);
+  std::vector<int32_t> pairs= weightPairs(weights);
+  std::vector<const unsigned char*> taps(weights.size());
+
+  for (int y= yBegin; y < yEnd; y++) {
+    unsigned char* out= dst + y * rowBytes;
+    bool interior= y >= radius && y + radius < height && width > 2 * radius;
+
+    // the border strips, whole rows near the top and bottom
+    if (!interior) {
+      convolveClampedPixels(src, out, width, height, kernel, y, 0, width);
+      continue;
+    }
+    convolveClampedPixels(src, out, width, height, kernel, y, 0, radius);
+    convolveClampedPixels(src, out, width, height, kernel, y, width - radius, width);
+
+    for (int t= 0; t < numTaps; t++) {
+      int ky= t / kernel.side;
+      int kx= t % kernel.side;
+      taps[t]= src + (y + ky - radius) * rowBytes + (kx - radius) * CHANNELS;
+    }
+    if (numTaps < (int) taps.size()) taps[numTaps]= taps[0];
+
+    rowFunction(taps.data(), weights.data(), pairs.data(), taps.size(), 
+      kernel.shift, out, border, rowBytes - border);
+  }
+}
+
+void agl::convolveFixed(const unsigned char* src, unsigned char* dst, 
+  int width, int height, const FixedKernel& kernel)
+{
+  RowFunction rowFunction= bestRowFunction();
+  ThreadPool::shared().parallelRows(height, [&](int begin, int end) {
+    convolveWith(rowFunction, src, dst, width, height, kernel, begin, end);
+  });
+}
+
+void agl::convolveFixedScalar(const unsigned char* src, unsigned char* dst, 
+  int width, int height, const FixedKernel& kernel)
+{
+  convolveWith(convolveRowScalar, src, dst, width, height, kernel, 0, height);
+}
+
+void agl::weightedRowSum(const unsigned char* const* rows, const int16_t* weights, 
+  int numRows, int shift, unsigned char* out, int bytes)
+{
+  // taps go two at a time, an odd one out gets a zero weight partner
+  int numTaps= numRows + numRows % 2;
+  std::vector<const unsigned char*> taps(rows, rows + numRows);
+  std::vector<int16_t> padded(weights, weights + numRows);
+  if (numTaps > numRows) {
+    taps.push_back(rows[0]);
+    padded.push_back(0);
+  }
+  std::vector<int32_t> pairs= weightPairs(padded);
+  bestRowFunction()(taps.data(), padded.data(), pairs.data(), numTaps, shift, 
+    out, 0, bytes);
+}
@@ -0,0 +1,51 @@
+/*-----------------------------------------------
+ * Description: Fixed point convolution of RGB
+ * images with small integer kernels, with SSE2
+ * and AVX2 versions picked at runtime.
+ ----------------------------------------------*/
+
+#ifndef convolve_H_
+#define convolve_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace agl
+{
+  /**
+   * An integer kernel ready for convolveFixed. The weights are the
+   * kernel already mirrored (in the order of the pixels they multiply)
+   * and multiplied by the scale's numerator, so each output byte is
+   *   clamp((sum of weight * pixel) >> shift, 0, 255)
+   * which is exactly what truncating the float sum gives.
+  */
+  struct FixedKernel {
+    std::vector<int16_t> weights;
+    int side;
+    int shift;
+  };
+
+  // Turns kernel * scale into a FixedKernel when scale is n / 2^s
+  // (s <= 16) and the sums fit in 32 bits, returns false otherwise
+  bool makeFixedKernel(const int kernel[], float scale, int side, 
+    FixedKernel& fixed);
+
+  // Convolves the width x height RGB image src into dst, repeating the
+  // edge pixels past the borders. Uses the widest SIMD the CPU has,
+  // on bands of rows in parallel
+  void convolveFixed(const unsigned char* src, unsigned char* dst, 
+    int width, int height, const FixedKernel& kernel);
+
+  // The plain single threaded C++ version, every other version
+  // matches it bit for bit
+  void convolveFixedScalar(const unsigned char* src, unsigned char* dst, 
+    int width, int height, const FixedKernel& kernel);
+
+  // The weighted sum of numRows rows of bytes,
+  //   out[i] = clamp((sum of weights[r] * rows[r][i]) >> shift, 0, 255)
+  // for i in [0, bytes), with the widest SIMD the CPU has
+  void weightedRowSum(const unsigned char* const* rows, const int16_t* weights, 
+    int numRows, int shift, unsigned char* out, int bytes);
+}
+
+#endif
@@ -22,7 +22,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-add.png");
+   drawer.saveAsync("flow-add.png");
 
    drawer.begin(FLOW, ALPHA, 0.15f);
    drawer.color(2, 0, 130);
@@ -32,7 +32,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-blend-1.png");
+   drawer.saveAsync("flow-blend-1.png");
 
    drawer.begin(FLOW, ALPHA, 0.025f);
    drawer.color(188, 23, 20);
@@ -42,7 +42,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-blend-2.png");
+   drawer.saveAsync("flow-blend-2.png");
 
    std::vector<Pixel> palette2;
    palette2.push_back(Pixel{0x6F, 0xA8, 0xDC});
@@ -63,7 +63,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-pal-0.png");
+   drawer.saveAsync("flow-pal-0.png");
 
    drawer.begin(FLOW, ALPHA, 0.15f);
    drawer.color(palette2[1].r, palette2[1].g, palette2[1].b);
@@ -73,7 +73,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-pal-1.png");
+   drawer.saveAsync("flow-pal-1.png");
 
    drawer.begin(FLOW, ALPHA, 0.10f);
    drawer.color(palette2[2].r, palette2[2].g, palette2[2].b);
@@ -83,7 +83,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-pal-2.png");
+   drawer.saveAsync("flow-pal-2.png");
 
    drawer.begin(FLOW, ALPHA, 0.05f);
    drawer.color(palette2[3].r, palette2[3].g, palette2[3].b);
@@ -93,7 +93,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-pal-3.png");
+   drawer.saveAsync("flow-pal-3.png");
 
    drawer.begin(FLOW, ALPHA, 0.025f);
    drawer.color(palette2[4].r, palette2[4].g, palette2[4].b);
@@ -103,7 +103,7 @@ int main(int argc, char** argv)
       }
    }
    drawer.end();
-   drawer.save("flow-pal-4.png");
+   drawer.saveAsync("flow-pal-4.png");
 
 
    drawer.background(0, 0, 0);
@@ -114,7 +114,7 @@ int main(int argc, char** argv)
       drawer.vertex(rand()%width, rand()%height);
    }
    drawer.end();
-   drawer.save("flow-add-red.png");
+   drawer.saveAsync("flow-add-red.png");
 
 
    drawer.begin(FLOW, ADD);
@@ -124,7 +124,7 @@ int main(int argc, char** argv)
       drawer.vertex(rand()%width, rand()%height);
    }
    drawer.end();
-   drawer.save("flow-add-green.png");
+   drawer.saveAsync("flow-add-green.png");
 
 
    drawer.begin(FLOW, ADD);
@@ -134,7 +134,7 @@ int main(int argc, char** argv)
       drawer.vertex(rand()%width, rand()%height);
    }
    drawer.end();
-   drawer.save("flow-add-blue.png");
+   drawer.saveAsync("flow-add-blue.png");
 
    width= 1000;
    height= 1000;
@@ -1,9 +1,85 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <vector>
 #include "canvas.h"
 
 using namespace agl;
 using namespace std;
 
+// The resize weights of every source pixel for each output pixel, in
+// double precision straight from the filter definitions
+vector<vector<double>> reference_weights(int in, int out, ResampleFilter filter)
+{
+   double scale= (double) in / out;
+   double stretch= max(scale, 1.0);
+   auto sinc= [](double x) { return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x); };
+   vector<vector<double>> weights(out, vector<double>(in, 0));
+   for (int o= 0; o < out; o++) {
+      double center= (o + 0.5) * scale;
+      double total= 0;
+      for (int x= 0; x < in; x++) {
+         double t= (x + 0.5 - center) / stretch;
+         double w= 0;
+         if (filter == BILINEAR) w= max(1 - fabs(t), 0.0);
+         else if (filter == LANCZOS3) w= fabs(t) < 3 ? sinc(t) * sinc(t / 3) : 0;
+         else w= max(min(x + 1.0, center + scale / 2) - max((double) x, center - scale / 2), 0.0);
+         weights[o][x]= w;
+         total+= w;
+      }
+      for (int x= 0; x < in; x++) weights[o][x]/= total;
+   }
+   return weights;
+}
+
+// Resizes an image where every third column is white and checks each
+// filter against the reference, at a ratio that puts source pixel
+// centers right on the output pixel edges. Returns false if any pixel
+// is off by more than 1
+bool test_resample(int inWidth, int inHeight, int outWidth, int outHeight)
+{
+   Image image(inWidth, inHeight);
+   for (int y= 0; y < inHeight; y++) {
+      for (int x= 0; x < inWidth; x++) {
+         unsigned char v= (x % 3 == 0) ? 255 : 0;
+         image.set(y, x, Pixel{v, (unsigned char) (y * 37 % 256), (unsigned char) (x * y % 256)});
+      }
+   }
+
+   bool passed= true;
+   for (ResampleFilter filter: {BILINEAR, AREA, LANCZOS3}) {
+      Image resized= image.resize(outWidth, outHeight, filter);
+      vector<vector<double>> wx= reference_weights(inWidth, outWidth, filter);
+      vector<vector<double>> wy= reference_weights(inHeight, outHeight, filter);
+      int worst= 0;
+      for (int y= 0; y < outHeight; y++) {
+         for (int x= 0; x < outWidth; x++) {
+            for (int c= 0; c < 3; c++) {
+               // horizontal pass clamped to bytes, as resize does
+               double sum= 0;
+               for (int sy= 0; sy < inHeight; sy++) {
+                  if (wy[y][sy] == 0) continue;
+                  double row= 0;
+                  for (int sx= 0; sx < inWidth; sx++) {
+                     row+= wx[x][sx] * image.data()[(sy * inWidth + sx) * 3 + c];
+                  }
+                  sum+= wy[y][sy] * min(max(row, 0.0), 255.0);
+               }
+               int expected= (int) lround(min(max(sum, 0.0), 255.0));
+               int actual= resized.data()[(y * outWidth + x) * 3 + c];
+               worst= max(worst, abs(expected - actual));
+            }
+         }
+      }
+      if (worst > 1) {
+         cout << "resize " << inWidth << "x" << inHeight << " to " << outWidth << "x"
+            << outHeight << " with filter " << filter << " is off by " << worst << endl;
+         passed= false;
+      }
+   }
+   return passed;
+}
+
 void test_line(Canvas& drawer, int ax, int ay, int bx, int by, const std::string& savename)
 {
    drawer.background(0, 0, 0);
@@ -16,6 +92,10 @@ void test_line(Canvas& drawer, int ax, int ay, int bx, int by, const std::string
 
 int main(int argc, char** argv)
 {
+  bool resampled= test_resample(300, 4, 200, 3);
+  resampled= test_resample(200, 3, 300, 4) && resampled;
+  resampled= test_resample(7, 5, 3, 2) && resampled;
+  if (!resampled) return 1;
    
   Canvas drawer(100, 100);
 
@@ -39,16 +39,100 @@
 */
 
 #include "image.h"
+#include "channel_lut.h"
+#include "convolve.h"
+#include "image_expr.h"
+#include "image_formats.h"
+#include "image_kernels.h"
+#include "image_pool.h"
+#include "pixel_ops.h"
+#include "resample.h"
+#include "thread_pool.h"
 #include <cassert>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb/stb_image_write.h"
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb/stb_image.h"
 #include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <cmath>
 #include <stdlib.h>
 #include <time.h>
+#include <vector>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+/**
+ * stb allocates through alignedAlloc, so the pixels stbi_load returns
+ * are a buffer like any other Image buffer, which load adopts and
+ * later hands to the ImagePool instead of copying. loadInto lends stb
+ * the image's own buffer: the first allocation of the right size while
+ * it is lent gets it, and freeing it only hands it back. Whether or not
+ * the decoded pixels end up there, they are in it once loadInto returns.
+*/
+struct LentBuffer {
+  unsigned char* data= nullptr;
+  size_t minBytes= 0;   // the smallest allocation it is given to
+  size_t maxBytes= 0;   // how much it holds
+  bool inUse= false;
+};
+thread_local LentBuffer lentBuffer;
+
+void* stbiMalloc(size_t bytes)
+{
+  LentBuffer& lent= lentBuffer;
+  if (lent.data != nullptr && !lent.inUse && bytes >= lent.minBytes && bytes <= lent.maxBytes) {
+    lent.inUse= true;
+    return lent.data;
+  }
+  return agl::alignedAlloc(std::max(bytes, (size_t) 1));
+}
+
+void stbiFree(void* data)
+{
+  if (data != nullptr && data == lentBuffer.data) {
+    lentBuffer.inUse= false;
+    return;
+  }
+  agl::alignedFree((unsigned char*) data);
+}
+
+void* stbiReallocSized(void* data, size_t oldBytes, size_t newBytes)
+{
+  unsigned char* grown= agl::alignedAlloc(std::max(newBytes, (size_t) 1));
+  if (grown == nullptr) return nullptr; // the old block stays, as with realloc
+  if (data != nullptr) std::memcpy(grown, data, std::min(oldBytes, newBytes));
+  stbiFree(data);
+  return grown;
+}
+
+// Only the animated GIF loader, which Image doesn't use, reallocates
+// without the old size
+void* stbiRealloc(void* data, size_t newBytes)
+{
+  if (data != nullptr && data == lentBuffer.data) {
+    return stbiReallocSized(data, lentBuffer.maxBytes, newBytes);
+  }
+#if defined(_WIN32)
+  return _aligned_realloc(data, newBytes, agl::PIXEL_ALIGNMENT);
+#else
+  // realloc may lose the alignment, then the block moves once more
+  void* moved= realloc(data, newBytes);
+  if (moved == nullptr || (uintptr_t) moved % agl::PIXEL_ALIGNMENT == 0) return moved;
+  unsigned char* aligned= agl::alignedAlloc(newBytes);
+  if (aligned != nullptr) std::memcpy(aligned, moved, newBytes);
+  free(moved);
+  return aligned;
+#endif
+}
+
+#define STBI_MALLOC(bytes) stbiMalloc(bytes)
+#define STBI_FREE(data) stbiFree(data)
+#define STBI_REALLOC(data, newBytes) stbiRealloc(data, newBytes)
+#define STBI_REALLOC_SIZED(data, oldBytes, newBytes) stbiReallocSized(data, oldBytes, newBytes)
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
 
 #define NUM_CHANNELS 3 // assumes that there will only be three components in an image
 
@@ -56,17 +140,280 @@ namespace agl {
 
 enum Color { RED = 0, GREEN, BLUE };
 
+// Blur kernel weights are fixed point, they add up to BLUR_WEIGHT_ONE
+const int BLUR_WEIGHT_BITS= 14;
+const int BLUR_WEIGHT_ONE= 1 << BLUR_WEIGHT_BITS;
+
+// Fractional bits kept between the two passes of separableBlur
+const int BLUR_MID_BITS= 8;
+
 // Function to clamp value
 int clamp(int value, int low, int hi) {
   return std::min(std::max(value, low), hi);
 }
 
+/**
+ * Divides by a fixed d rounding to nearest, using a multiply and a
+ * shift instead of a divide. With m = ceil(2^48 / d) the quotient is
+ * exact as long as the numerator stays below 2^48 / d, which holds
+ * for the box sums (at most 255 * d) while d < 2^20. Past that it
+ * falls back to dividing.
+*/
+struct RoundingDivider {
+  uint64_t d;
+  uint64_t m;
+
+  RoundingDivider(uint64_t divisor) : d(divisor), 
+    m(((uint64_t(1) << 48) + divisor - 1) / divisor) {}
+
+  unsigned operator()(uint64_t x) const
+  {
+    x+= this->d / 2;
+    if (this->d < (1u << 20)) return (x * this->m) >> 48;
+    return x / this->d;
+  }
+};
+
+/**
+ * Averages the (2*radius+1)^2 square around every pixel, repeating
+ * the edge pixels past the borders. colSums holds, for each byte of
+ * a row, the sum of the 2*radius+1 bytes above and below it; moving
+ * down a row adds the row entering the window and subtracts the one
+ * leaving. A running sum along colSums then gives each square, so
+ * the cost per pixel doesn't depend on the radius. Only the rows
+ * [yBegin, yEnd) of dst are written.
+*/
+void slidingBoxBlur(const unsigned char* src, unsigned char* dst, 
+  int width, int height, int radius, int yBegin, int yEnd)
+{
+  const int rowBytes= width * NUM_CHANNELS;
+  const int window= 2 * radius + 1;
+  RoundingDivider divide((uint64_t) window * window);
+  std::vector<uint32_t> colSums(rowBytes, 0);
+
+  // e.g. the window of row 0 is row 0 repeated radius+1 times plus rows 1..radius
+  for (int k= yBegin - radius; k <= yBegin + radius; k++) {
+    const unsigned char* row= src + clamp(k, 0, height - 1) * rowBytes;
+    for (int i= 0; i < rowBytes; i++) colSums[i]+= row[i];
+  }
+
+  for (int y= yBegin; y < yEnd; y++) {
+    unsigned char* out= dst + y * rowBytes;
+
+    for (int c= 0; c < NUM_CHANNELS; c++) {
+      uint64_t sum= 0;
+      for (int k= -radius; k <= radius; k++) {
+        sum+= colSums[clamp(k, 0, width - 1) * NUM_CHANNELS + c];
+      }
+      for (int x= 0; x < width; x++) {
+        out[x * NUM_CHANNELS + c]= divide(sum);
+        int enter= std::min(x + radius + 1, width - 1);
+        int leave= std::max(x - radius, 0);
+        sum+= colSums[enter * NUM_CHANNELS + c];
+        sum-= colSums[leave * NUM_CHANNELS + c];
+      }
+    }
+
+    if (y + 1 < yEnd) {
+      const unsigned char* enter= src + std::min(y + radius + 1, height - 1) * rowBytes;
+      const unsigned char* leave= src + std::max(y - radius, 0) * rowBytes;
+      for (int i= 0; i < rowBytes; i++) colSums[i]+= enter[i] - leave[i];
+    }
+  }
+}
+
+/**
+ * The Sobel operator in one pass over the rows [yBegin, yEnd), edge
+ * pixels are repeated past the borders. gx and gy of each channel are
+ * summed straight from the 3x3 neighborhood in signed ints, so a
+ * negative gradient counts as much as a positive one, and the magnitude
+ * is floor(sqrt(gx^2 + gy^2)) clamped to 255. If orientation isn't
+ * null it gets atan2(gy, gx), mapped from [-pi, pi] to [0, 255].
+*/
+void sobelRows(const unsigned char* src, unsigned char* magnitude, 
+  unsigned char* orientation, int width, int height, int yBegin, int yEnd)
+{
+  const int rowBytes= width * NUM_CHANNELS;
+  const float angleScale= 255.0f / (2 * M_PI);
+
+  for (int y= yBegin; y < yEnd; y++) {
+    const unsigned char* up= src + std::max(y - 1, 0) * rowBytes;
+    const unsigned char* mid= src + y * rowBytes;
+    const unsigned char* down= src + std::min(y + 1, height - 1) * rowBytes;
+    unsigned char* out= magnitude + y * rowBytes;
+
+    for (int x= 0; x < width; x++) {
+      int l= std::max(x - 1, 0) * NUM_CHANNELS;
+      int c= x * NUM_CHANNELS;
+      int r= std::min(x + 1, width - 1) * NUM_CHANNELS;
+
+      for (int ch= 0; ch < NUM_CHANNELS; ch++) {
+        int gx= (up[r+ch] + 2 * mid[r+ch] + down[r+ch]) - 
+          (up[l+ch] + 2 * mid[l+ch] + down[l+ch]);
+        int gy= (down[l+ch] + 2 * down[c+ch] + down[r+ch]) - 
+          (up[l+ch] + 2 * up[c+ch] + up[r+ch]);
+
+        // below 255^2 the float root truncates to the exact integer root
+        int squared= gx * gx + gy * gy;
+        out[c+ch]= squared >= 255 * 255 ? 255 : (int) std::sqrt((float) squared);
+
+        if (orientation != nullptr) {
+          float angle= std::atan2((float) gy, (float) gx) + (float) M_PI;
+          orientation[y * rowBytes + c + ch]= (int) (angle * angleScale + 0.5f);
+        }
+      }
+    }
+  }
+}
+
+// Copies a row of numPixels pixels into out last pixel first. in and
+// out may be the same row
+void reversePixels(const unsigned char* in, unsigned char* out, int numPixels)
+{
+  int left= 0;
+  int right= numPixels - 1;
+  for (; left <= right; left++, right--) {
+    unsigned char l[NUM_CHANNELS]= {in[left * NUM_CHANNELS], 
+      in[left * NUM_CHANNELS + 1], in[left * NUM_CHANNELS + 2]};
+    std::memmove(out + left * NUM_CHANNELS, in + right * NUM_CHANNELS, NUM_CHANNELS);
+    std::memcpy(out + right * NUM_CHANNELS, l, NUM_CHANNELS);
+  }
+}
+
+// Pixels per side of the tiles transposeRows works through
+const int TRANSPOSE_TILE= 16;
+
+/**
+ * Writes the rows [yBegin, yEnd) of dst, the transpose of the width x
+ * height image src, with dst's rows in reverse order when reverseRows
+ * and its columns in reverse order when reverseColumns. Going tile by
+ * tile, the few source rows a tile reads stay in cache while dst fills
+ * in whole runs of TRANSPOSE_TILE pixels, instead of every write
+ * landing a full row of dst away from the last one.
+*/
+void transposeRows(const unsigned char* src, unsigned char* dst, int width, 
+  int height, bool reverseRows, bool reverseColumns, int yBegin, int yEnd)
+{
+  // dst is height pixels wide and width tall
+  for (int y0= yBegin; y0 < yEnd; y0+= TRANSPOSE_TILE) {
+    int y1= std::min(y0 + TRANSPOSE_TILE, yEnd);
+    for (int x0= 0; x0 < height; x0+= TRANSPOSE_TILE) {
+      int x1= std::min(x0 + TRANSPOSE_TILE, height);
+      for (int y= y0; y < y1; y++) {
+        int column= reverseRows ? width - 1 - y : y;
+        unsigned char* out= dst + (y * height + x0) * NUM_CHANNELS;
+        for (int x= x0; x < x1; x++, out+= NUM_CHANNELS) {
+          int row= reverseColumns ? height - 1 - x : x;
+          const unsigned char* in= src + (row * width + column) * NUM_CHANNELS;
+          out[RED]= in[RED];
+          out[GREEN]= in[GREEN];
+          out[BLUE]= in[BLUE];
+        }
+      }
+    }
+  }
+}
+
+// Gaussian weights reaching 3 sigma out, in BLUR_WEIGHT_BITS fixed point
+std::vector<int> gaussianWeights(float sigma)
+{
+  int radius= std::max(1, (int) std::ceil(3 * sigma));
+  std::vector<float> exact(2 * radius + 1);
+  float total= 0;
+  for (int k= -radius; k <= radius; k++) {
+    exact[k + radius]= std::exp(-(k * k) / (2 * sigma * sigma));
+    total+= exact[k + radius];
+  }
+
+  std::vector<int> weights(2 * radius + 1);
+  int sum= 0;
+  for (int i= 0; i < (int) weights.size(); i++) {
+    weights[i]= (int) std::lround(exact[i] / total * BLUR_WEIGHT_ONE);
+    sum+= weights[i];
+  }
+  // rounding may leave the weights off by a little, the center absorbs it
+  weights[radius]+= BLUR_WEIGHT_ONE - sum;
+  return weights;
+}
+
+/**
+ * Convolves with the same 1D kernel vertically then horizontally,
+ * repeating the edge pixels past the borders. The weights are odd in
+ * number, centered and add up to BLUR_WEIGHT_ONE. Each row is first
+ * summed vertically into a 16 bit row with BLUR_MID_BITS fractional
+ * bits, padded with copies of its edge pixels, which the horizontal
+ * pass then sums into the output row. Only the rows [yBegin, yEnd)
+ * of dst are written.
+*/
+void separableBlurRows(const unsigned char* src, unsigned char* dst, 
+  int width, int height, const std::vector<int>& weights, int yBegin, int yEnd)
+{
+  const int rowBytes= width * NUM_CHANNELS;
+  const int radius= weights.size() / 2;
+  const int midShift= BLUR_WEIGHT_BITS - BLUR_MID_BITS;
+  const int outShift= BLUR_WEIGHT_BITS + BLUR_MID_BITS;
+  std::vector<uint32_t> column(rowBytes);
+  std::vector<uint16_t> padded((width + 2 * radius) * NUM_CHANNELS);
+  uint16_t* mid= &padded[radius * NUM_CHANNELS];
+
+  for (int y= yBegin; y < yEnd; y++) {
+    std::fill(column.begin(), column.end(), 0);
+    for (int k= -radius; k <= radius; k++) {
+      const unsigned char* row= src + clamp(y + k, 0, height - 1) * rowBytes;
+      uint32_t w= weights[k + radius];
+      for (int i= 0; i < rowBytes; i++) column[i]+= w * row[i];
+    }
+    for (int i= 0; i < rowBytes; i++) {
+      mid[i]= (column[i] + (1u << (midShift - 1))) >> midShift;
+    }
+    for (int k= 1; k <= radius; k++) {
+      for (int c= 0; c < NUM_CHANNELS; c++) {
+        mid[-k * NUM_CHANNELS + c]= mid[c];
+        mid[(width - 1 + k) * NUM_CHANNELS + c]= mid[(width - 1) * NUM_CHANNELS + c];
+      }
+    }
+
+    unsigned char* out= dst + y * rowBytes;
+    for (int x= 0; x < width; x++) {
+      uint32_t sum[NUM_CHANNELS]= {0, 0, 0};
+      for (int k= -radius; k <= radius; k++) {
+        const uint16_t* tap= &mid[(x + k) * NUM_CHANNELS];
+        uint32_t w= weights[k + radius];
+        sum[RED]+= w * tap[RED];
+        sum[GREEN]+= w * tap[GREEN];
+        sum[BLUE]+= w * tap[BLUE];
+      }
+      for (int c= 0; c < NUM_CHANNELS; c++) {
+        out[x * NUM_CHANNELS + c]= std::min(
+          (sum[c] + (1u << (outShift - 1))) >> outShift, 255u);
+      }
+    }
+  }
+}
+
+// separableBlurRows over every row, a band of rows per task
+void separableBlur(const unsigned char* src, unsigned char* dst, 
+  int width, int height, const std::vector<int>& weights)
+{
+  ThreadPool::shared().parallelRows(height, [&](int begin, int end) {
+    separableBlurRows(src, dst, width, height, weights, begin, end);
+  });
+}
+
 Image::Image() {
   this->myData= nullptr;
+  this->myMapping= nullptr;
+  this->myMappedBytes= 0;
+  this->myWidth= 0;
+  this->myHeight= 0;
+  this->totalBytes= 0;
+  this->totalPixels= 0;
 }
 
 Image::Image(int width, int height): myWidth(width), myHeight(height) {
-  this->myData= new unsigned char[width * height * NUM_CHANNELS];
+  this->myData= ImagePool::shared().acquire(width, height);
+  this->myMapping= nullptr;
+  this->myMappedBytes= 0;
   this->totalBytes= width * height * NUM_CHANNELS;
   this->totalPixels= width * height;
 }
@@ -74,6 +421,7 @@ Image::Image(int width, int height): myWidth(width), myHeight(height) {
 
 Image::Image(const Image& orig) {
   this->myData= nullptr;
+  this->myMapping= nullptr;
   this->set(orig.width(), orig.height(), orig.data());
 }
 
@@ -86,8 +434,68 @@ Image& Image::operator=(const Image& orig) {
   return *this;
 }
 
+Image::Image(Image&& orig) noexcept {
+  this->myData= orig.myData;
+  this->myWidth= orig.myWidth;
+  this->myHeight= orig.myHeight;
+  this->totalBytes= orig.totalBytes;
+  this->totalPixels= orig.totalPixels;
+  this->myMapping= orig.myMapping;
+  this->myMappedBytes= orig.myMappedBytes;
+
+  orig.myData= nullptr;
+  orig.myMapping= nullptr;
+  orig.myWidth= orig.myHeight= 0;
+  orig.totalBytes= orig.totalPixels= 0;
+}
+
+Image& Image::operator=(Image&& orig) noexcept {
+  if (&orig == this) {
+    return *this;
+  }
+  this->_releaseData();
+  this->myData= orig.myData;
+  this->myWidth= orig.myWidth;
+  this->myHeight= orig.myHeight;
+  this->totalBytes= orig.totalBytes;
+  this->totalPixels= orig.totalPixels;
+  this->myMapping= orig.myMapping;
+  this->myMappedBytes= orig.myMappedBytes;
+
+  orig.myData= nullptr;
+  orig.myMapping= nullptr;
+  orig.myWidth= orig.myHeight= 0;
+  orig.totalBytes= orig.totalPixels= 0;
+
+  return *this;
+}
+
 Image::~Image() {
-  if (this->myData != nullptr) delete[] this->myData;
+  this->_releaseData();
+}
+
+void Image::_releaseData() {
+  if (this->myMapping != nullptr) {
+    unmapRaw(this->myMapping, this->myMappedBytes);
+    this->myMapping= nullptr;
+    this->myData= nullptr;
+  }
+  else if (this->myData != nullptr) {
+    ImagePool::shared().release(this->myData, this->myWidth, this->myHeight);
+    this->myData= nullptr;
+  }
+}
+
+void Image::_reshape(int width, int height) {
+  if (this->myData != nullptr && width == this->myWidth && height == this->myHeight) {
+    return;
+  }
+  this->_releaseData();
+  this->myData= ImagePool::shared().acquire(width, height);
+  this->myWidth= width;
+  this->myHeight= height;
+  this->totalBytes= width * height * NUM_CHANNELS;
+  this->totalPixels= width * height;
 }
 
 int Image::width() const {
@@ -112,42 +520,104 @@ int Image::pixelCount() const {
 
 void Image::set(int width, int height, unsigned char* data) {
   assert(sizeof(data) != width * height * NUM_CHANNELS);
-  this->myWidth= width;
-  this->myHeight= height;
-  this->totalBytes= this->myWidth * this->myHeight * NUM_CHANNELS;
-  this->totalPixels= this->myWidth * this->myHeight;
 
-  // Assures that we clean up the data we are replacing to avoid leaks
-  if (this->myData != nullptr) {
-    delete[] this->myData;
-    this->myData= nullptr;
+  this->_reshape(width, height);
+
+  if (this->myData != data && this->totalBytes > 0) {
+    std::memcpy(this->myData, data, this->totalBytes);
   }
-  this->myData= new unsigned char[this->totalBytes];
-  std::memcpy(this->myData, data, this->totalBytes);
 }
 
 // Assumes that flip is false for now
 bool Image::load(const std::string& filename, bool flip) {
-  const char* file= filename.c_str();
-  unsigned char* data= stbi_load(file, &this->myWidth, &myHeight, nullptr, 3); // force it to have 4 channels
+  int width, height;
+  if (imageFormat(filename) == RAW) {
+    void* mapping;
+    size_t mappedBytes;
+    unsigned char* pixels= mapRaw(filename, width, height, mapping, mappedBytes);
+    if (pixels != nullptr) {
+      this->_releaseData();
+      this->myData= pixels;
+      this->myMapping= mapping;
+      this->myMappedBytes= mappedBytes;
+      this->myWidth= width;
+      this->myHeight= height;
+      this->totalBytes= width * height * NUM_CHANNELS;
+      this->totalPixels= width * height;
+      return true;
+    }
 
-  bool success= data != nullptr;
+    // padded rows, alpha or no mmap
+    std::vector<unsigned char> pixelData;
+    bool success= readRaw(filename, pixelData, width, height);
+    if (success) this->set(width, height, pixelData.data());
+    return success;
+  }
+  if (imageFormat(filename) == QOI) {
+    std::vector<unsigned char> pixels;
+    bool success= readQOI(filename, pixels, width, height);
+    if (success) this->set(width, height, pixels.data());
+    return success;
+  }
+
+  const char* file= filename.c_str();
+  unsigned char* data= stbi_load(file, &width, &height, nullptr, 3); // force it to have 3 channels
 
   // so we don't set if it fails
-  if (success) this->set(this->myWidth, this->myHeight, data);
+  if (data == nullptr) return false;
+
+  // stb's buffer came from alignedAlloc, so we keep it
+  this->_releaseData();
+  this->myData= data;
+  this->myWidth= width;
+  this->myHeight= height;
+  this->totalBytes= width * height * NUM_CHANNELS;
+  this->totalPixels= width * height;
+  return true;
+}
 
-  stbi_image_free(data);
+bool Image::loadInto(const std::string& filename) {
+  int width, height;
+  if (this->myData == nullptr || !probe(filename, width, height) || 
+    width != this->myWidth || height != this->myHeight) {
+    return false;
+  }
 
+  ImageFormat format= imageFormat(filename);
+  if (format == QOI || format == RAW) {
+    std::vector<unsigned char> pixels;
+    bool success= (format == QOI) ? readQOI(filename, pixels, width, height) :
+      readRaw(filename, pixels, width, height);
+    success= success && width == this->myWidth && height == this->myHeight;
+    if (success) std::memcpy(this->myData, pixels.data(), this->totalBytes);
+    return success;
+  }
+
+  // a mapped buffer ends with the file, a pool buffer is rounded up
+  size_t capacity= this->myMapping != nullptr ? this->totalBytes :
+    (this->totalBytes + PIXEL_ALIGNMENT - 1) / PIXEL_ALIGNMENT * PIXEL_ALIGNMENT;
+  lentBuffer= LentBuffer();
+  lentBuffer.data= this->myData;
+  lentBuffer.minBytes= this->totalBytes;
+  lentBuffer.maxBytes= capacity;
+  unsigned char* data= stbi_load(filename.c_str(), &width, &height, nullptr, 3);
+  lentBuffer= LentBuffer();
+
+  bool success= data != nullptr && width == this->myWidth && height == this->myHeight;
+  if (success && data != this->myData) {
+    std::memcpy(this->myData, data, this->totalBytes);
+  }
+  if (data != this->myData) stbi_image_free(data);
   return success;
 }
 
-// Assumes that flip is false for now
-bool Image::save(const std::string& filename, bool flip) const {
-  const char* file= filename.c_str();
-  int success= stbi_write_png(file, this->myWidth, this->myHeight, NUM_CHANNELS, 
-    this->myData, this->myWidth * NUM_CHANNELS);
+bool Image::probe(const std::string& filename, int& width, int& height) {
+  return probeImage(filename, width, height);
+}
 
-  return success == 1;
+bool Image::save(const std::string& filename, bool flip, int level, int quality) const {
+  return writeImage(filename, this->myData, this->myWidth, this->myHeight, flip,
+    level, quality);
 }
 
 Pixel Image::get(int row, int col) const {
@@ -185,88 +655,172 @@ void Image::set(int i, const Pixel& c)
   this->myData[idx + BLUE]= c.b;
 }
 
-Image Image::resize(int w, int h) const {
+Image Image::resize(int w, int h, ResampleFilter filter) const {
   Image result(w, h);
-  int i_1;
-  int j_1;
-  for (int i_2= 0; i_2 < h; i_2++) {
-    for (int j_2= 0; j_2 < w; j_2++) {
-      float rowRatio_2= (float) i_2 / (float) (h-1);
-      float colRatio_2= (float) j_2 / (float) (w-1);
-
-      i_1= rowRatio_2 * (this->myHeight - 1);
-      j_1= colRatio_2 * (this->myWidth - 1);
-      
-      result.set(i_2, j_2, this->get(i_1, j_1));
-    }
-  }
+  this->resize(w, h, filter, result);
   return result;
 }
 
+void Image::resize(int w, int h, ResampleFilter filter, Image& dst) const {
+  if (&dst == this) {
+    dst= this->resize(w, h, filter);
+    return;
+  }
+  dst._reshape(w, h);
+  resample(this->myData, this->myWidth, this->myHeight, dst.myData, w, h, filter);
+}
+
 Image Image::flipHorizontal() const {
   Image result(this->myWidth, this->myHeight);
+  this->flipHorizontal(result);
+  return result;
+}
 
-  for (int i_start= 0; i_start < this->myHeight; i_start++) {
+void Image::flipHorizontal(Image& dst) const {
+  const int rowBytes= this->myWidth * NUM_CHANNELS;
 
-    // corresponding index of the pixel on the other side of the middle line
-    int i_end= this->myHeight - 1 - i_start;
-    for (int j= 0; j < this->myWidth; j++) {
-      
-      result.set(i_start, j, this->get(i_end, j));
-    }
+  if (&dst == this) {
+    // swaps the rows of the top half with their mirrors
+    ThreadPool::shared().parallelRows(this->myHeight / 2, [&](int begin, int end) {
+      for (int i= begin; i < end; i++) {
+        unsigned char* top= this->myData + i * rowBytes;
+        unsigned char* bottom= this->myData + (this->myHeight - 1 - i) * rowBytes;
+        std::swap_ranges(top, top + rowBytes, bottom);
+      }
+    });
+    return;
   }
-  return result;
+
+  dst._reshape(this->myWidth, this->myHeight);
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      std::memcpy(dst.myData + i * rowBytes, 
+        this->myData + (this->myHeight - 1 - i) * rowBytes, rowBytes);
+    }
+  });
 }
 
 Image Image::flipVertical() const {
-  Image result(0, 0);
+  Image result(this->myWidth, this->myHeight);
+  this->flipVertical(result);
   return result;
 }
 
+void Image::flipVertical(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      const unsigned char* in= this->myData + i * this->myWidth * NUM_CHANNELS;
+      reversePixels(in, dst.myData + (in - this->myData), this->myWidth);
+    }
+  });
+}
+
 Image Image::flipPositiveDiagonal() const {
-  // switch dimensions to actually flip them correctly by swapping i,j -> j,i
   Image result(this->myHeight, this->myWidth);
+  this->flipPositiveDiagonal(result);
+  return result;
+}
 
-  // invariant is that we only traverse the bottom triangle
-  for (int i= 0; i < this->myHeight; i++) {
-    for (int j= 0; j < this->myWidth; j++) {
-      Pixel curPixel= this->get(i, j);
-      result.set(j, i, curPixel); // place the pixel in mirrored position
-    }
-  }
+void Image::flipPositiveDiagonal(Image& dst) const {
+  this->_transposeInto(dst, false, false);
+}
 
+Image Image::rotate90() const {
+  Image result(this->myHeight, this->myWidth);
+  this->rotate90(result);
   return result;
 }
 
-Image Image::rotate90() const {
-  Image flippedHorizontally= this->flipHorizontal();
-  Image result= flippedHorizontally.flipPositiveDiagonal();
-  
+void Image::rotate90(Image& dst) const {
+  // the bottom row becomes the left column
+  this->_transposeInto(dst, false, true);
+}
+
+Image Image::rotate180() const {
+  Image result(this->myWidth, this->myHeight);
+  this->rotate180(result);
+  return result;
+}
+
+void Image::rotate180(Image& dst) const {
+  // the pixels in reverse order, row i pairs with row height-1-i
+  dst._reshape(this->myWidth, this->myHeight);
+  const int rowBytes= this->myWidth * NUM_CHANNELS;
+  int numPairs= (this->myHeight + 1) / 2;
+  ThreadPool::shared().parallelRows(numPairs, [&](int begin, int end) {
+    // in place, the top row of each pair is kept here while it's overwritten
+    std::vector<unsigned char> top(&dst == this ? rowBytes : 0);
+    for (int i= begin; i < end; i++) {
+      int mirror= this->myHeight - 1 - i;
+      if (&dst == this) {
+        // done as two rows at once, the middle row with itself
+        std::copy(this->myData + i * rowBytes, this->myData + (i + 1) * rowBytes, 
+          top.begin());
+        reversePixels(this->myData + mirror * rowBytes, dst.myData + i * rowBytes, 
+          this->myWidth);
+        reversePixels(top.data(), dst.myData + mirror * rowBytes, this->myWidth);
+      } else {
+        reversePixels(this->myData + mirror * rowBytes, dst.myData + i * rowBytes, 
+          this->myWidth);
+        reversePixels(this->myData + i * rowBytes, dst.myData + mirror * rowBytes, 
+          this->myWidth);
+      }
+    }
+  });
+}
+
+Image Image::rotate270() const {
+  Image result(this->myHeight, this->myWidth);
+  this->rotate270(result);
   return result;
 }
 
+void Image::rotate270(Image& dst) const {
+  // the right column becomes the top row
+  this->_transposeInto(dst, true, false);
+}
+
+void Image::_transposeInto(Image& dst, bool reverseRows, bool reverseColumns) const {
+  if (&dst == this) {
+    Image copy= *this;
+    copy._transposeInto(dst, reverseRows, reverseColumns);
+    return;
+  }
+  dst._reshape(this->myHeight, this->myWidth);
+  ThreadPool::shared().parallelRows(this->myWidth, [&](int begin, int end) {
+    transposeRows(this->myData, dst.myData, this->myWidth, this->myHeight, 
+      reverseRows, reverseColumns, begin, end);
+  });
+}
+
 Image Image::subimage(int startx, int starty, int w, int h) const {
   // assures that the sub image is actually a subimage
   assert(startx + w < this->myWidth && starty + h < this->myHeight);
   Image sub(w, h);
 
-  for (int i= 0; i < h; i++) {
-    for (int j= 0; j < w; j++) {
-      sub.set(i, j, this->get(starty + i, startx + j));
+  ThreadPool::shared().parallelRows(h, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      for (int j= 0; j < w; j++) {
+        sub.set(i, j, this->get(starty + i, startx + j));
+      }
     }
-  }
+  });
 
   return sub;
 }
 
 void Image::replace(const Image& image, int startx, int starty) {
   // loop condition protects against index out of bounds error
-  for (int i= 0; i < image.height() && starty + i < this->myHeight; i++) {
-    for (int j= 0; j < image.width() && startx + j < this->myWidth; j++) {
+  int rows= std::min(image.height(), this->myHeight - starty);
+  ThreadPool::shared().parallelRows(rows, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      for (int j= 0; j < image.width() && startx + j < this->myWidth; j++) {
 
-      this->set(starty + i, startx + j, image.get(i, j));
+        this->set(starty + i, startx + j, image.get(i, j));
+      }
     }
-  }  
+  });
 }
 
 void Image::replaceColor(int x, int y, Pixel pixel)
@@ -295,210 +849,171 @@ void Image::alphaColor(int x, int y, Pixel pixel, float alpha) {
 }
 
 void Image::replaceAlpha(const Image& other, float alpha, int startx, int starty) {
-  for (int i= 0; i < other.height() && starty + i < this->myHeight; i++) {
-    for (int j= 0; j < other.width() && startx + j < this->myWidth; j++) {
-      Pixel blendedPixel {0, 0, 0};
-      Pixel pixel1= this->get(starty + i, startx + j);
-      Pixel pixel2= other.get(i, j);
-
-      blendedPixel.r= (float) pixel1.r * (1 - alpha) + (float) pixel2.r * alpha;
-      blendedPixel.g= (float) pixel1.g * (1 - alpha) + (float) pixel2.g * alpha;
-      blendedPixel.b= (float) pixel1.b * (1 - alpha) + (float) pixel2.b * alpha;
-      
-      this->set(starty + i, startx + j, blendedPixel);
+  int rows= std::min(other.height(), this->myHeight - starty);
+  ThreadPool::shared().parallelRows(rows, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      for (int j= 0; j < other.width() && startx + j < this->myWidth; j++) {
+        Pixel blendedPixel {0, 0, 0};
+        Pixel pixel1= this->get(starty + i, startx + j);
+        Pixel pixel2= other.get(i, j);
+
+        blendedPixel.r= (float) pixel1.r * (1 - alpha) + (float) pixel2.r * alpha;
+        blendedPixel.g= (float) pixel1.g * (1 - alpha) + (float) pixel2.g * alpha;
+        blendedPixel.b= (float) pixel1.b * (1 - alpha) + (float) pixel2.b * alpha;
+        
+        this->set(starty + i, startx + j, blendedPixel);
+      }
     }
-  }  
+  });
 }
 
 Image Image::swirl() const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->myHeight; i++) {
-    for (int j= 0; j < this->myWidth; j++) {
-      Pixel pixel= this->get(i, j);
-      unsigned char tempRed= pixel.r;
-      pixel.r= pixel.g;
-      pixel.g= pixel.b;
-      pixel.b= tempRed;
-
-      result.set(i, j, pixel);
-    }
-  }
+  this->swirl(result);
   return result;
 }
 
+void Image::swirl(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, SwirlOp());
+}
+
 Image Image::add(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::min(pixel1.r + pixel2.r, 255);
-    resultPixel.g= std::min(pixel1.g + pixel2.g, 255);
-    resultPixel.b= std::min(pixel1.b + pixel2.b, 255);
-    result.set(i, resultPixel);
-  }
-  
+  this->add(other, result);
   return result;
 }
 
+void Image::add(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    AddOp());
+}
+
 Image Image::subtract(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::max(pixel1.r - pixel2.r, 0);
-    resultPixel.g= std::max(pixel1.g - pixel2.g, 0);
-    resultPixel.b= std::max(pixel1.b - pixel2.b, 0);
-    result.set(i, resultPixel);
-  }
-   
+  this->subtract(other, result);
   return result;
 }
 
+void Image::subtract(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    SubtractOp());
+}
+
 Image Image::multiply(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::min(pixel1.r * pixel2.r, 255);
-    resultPixel.g= std::min(pixel1.g * pixel2.g, 255);
-    resultPixel.b= std::min(pixel1.b * pixel2.b, 255);
-    result.set(i, resultPixel);
-  }
-   
+  this->multiply(other, result);
   return result;
 }
 
+void Image::multiply(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    MultiplyOp());
+}
+
 Image Image::difference(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::abs(pixel1.r - pixel2.r);
-    resultPixel.g= std::abs(pixel1.g - pixel2.g);
-    resultPixel.b= std::abs(pixel1.b - pixel2.b);
-    result.set(i, resultPixel);
-  }
-  
+  this->difference(other, result);
   return result;
 }
 
+void Image::difference(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    DifferenceOp());
+}
+
 Image Image::lightest(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::max(pixel1.r, pixel2.r);
-    resultPixel.g= std::max(pixel1.g, pixel2.g);
-    resultPixel.b= std::max(pixel1.b, pixel2.b);
-    result.set(i, resultPixel);
-  }
-  
+  this->lightest(other, result);
   return result;
 }
 
+void Image::lightest(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    LightestOp());
+}
+
 Image Image::darkest(const Image& other) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= this->get(i);
-    Pixel pixel2= other.get(i);
-    Pixel resultPixel;
-    resultPixel.r= std::min(pixel1.r, pixel2.r);
-    resultPixel.g= std::min(pixel1.g, pixel2.g);
-    resultPixel.b= std::min(pixel1.b, pixel2.b);
-    result.set(i, resultPixel);
-  }
-  
+  this->darkest(other, result);
   return result;
 }
 
+void Image::darkest(const Image& other, Image& dst) const {
+  assert(this->totalPixels == other.pixelCount());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    DarkestOp());
+}
+
 Image Image::gammaCorrect(float gamma) const {
   Image result(this->myWidth, this->myHeight);
-   
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
+  this->gammaCorrect(gamma, result);
+  return result;
+}
 
-    pixel.r= std::pow(pixel.r/255.0f, 1.0f/gamma) * 255;
-    pixel.g= std::pow(pixel.g/255.0f, 1.0f/gamma) * 255;
-    pixel.b= std::pow(pixel.b/255.0f, 1.0f/gamma) * 255;
+void Image::gammaCorrect(float gamma, Image& dst) const {
+  // a table lookup instead of three pows per pixel
+  this->applyLUT(ChannelLUT().gamma(gamma), dst);
+}
 
-    result.set(i, pixel);
-  }
-  
+Image Image::applyLUT(const ChannelLUT& lut) const {
+  Image result(this->myWidth, this->myHeight);
+  this->applyLUT(lut, result);
   return result;
 }
 
+void Image::applyLUT(const ChannelLUT& lut, Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  lut.apply(this->myData, dst.myData, this->myWidth, this->myHeight);
+}
+
 Image Image::alphaBlend(const Image& other, float alpha) const {
-  // assumes that images have the same dimensions
-  assert(this->myWidth == other.width() && this->myHeight == other.height());
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->myHeight; i++) {
-    for (int j= 0; j < this->myWidth; j++) {
-      Pixel blendedPixel= Pixel { 0, 0, 0 };
-      Pixel pixel1= this->get(i, j);
-      Pixel pixel2= other.get(i, j);
-
-      blendedPixel.r= (float) pixel1.r * (1 - alpha) + (float) pixel2.r * alpha;
-      blendedPixel.g= (float) pixel1.g * (1 - alpha) + (float) pixel2.g * alpha;
-      blendedPixel.b= (float) pixel1.b * (1 - alpha) + (float) pixel2.b * alpha;
-
-      result.set(i, j, blendedPixel);
-    } 
-  }
-
+  this->alphaBlend(other, alpha, result);
   return result;
 }
 
-Image Image::invert() const {
-  Image image(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
-
-    pixel.r= 255 - pixel.r;
-    pixel.g= 255 - pixel.g;
-    pixel.b= 255 - pixel.b;    
+void Image::alphaBlend(const Image& other, float alpha, Image& dst) const {
+  // assumes that images have the same dimensions
+  assert(this->myWidth == other.width() && this->myHeight == other.height());
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, other.myData, dst.myData, this->myWidth, this->myHeight, 
+    AlphaBlendOp {alpha});
+}
 
-    image.set(i, pixel);
+Image Image::invert() const {
+  Image result(this->myWidth, this->myHeight);
+  this->invert(result);
+  return result;
+}
 
-  }
-  return image;
+void Image::invert(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, InvertOp());
 }
 
 Image Image::grayscale() const {
   Image result(this->myWidth, this->myHeight);
-  Pixel pixel;
-  unsigned char intensity;
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    pixel= this->get(i);
-
-    // Hardcoded values to make the greyscale intensity to look pleasing to human eye
-    intensity= (float) pixel.r * 0.3f + (float) pixel.g * 0.59f + (float) pixel.b * 0.11f;
-    
-    pixel.r= intensity;
-    pixel.g= intensity;
-    pixel.b= intensity;
-
-    result.set(i, pixel);
-  }
-
+  this->grayscale(result);
   return result;
 }
 
+void Image::grayscale(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, GrayscaleOp());
+}
+
 Image Image::colorJitter(int size) const {
   Image image(this->myWidth, this->myHeight);
 
@@ -507,30 +1022,27 @@ Image Image::colorJitter(int size) const {
   int numCols= this->myWidth  / size + ((this->myWidth  % size != 0) ? 1 : 0);
   int numRows= this->myHeight / size + ((this->myHeight % size != 0) ? 1 : 0);
 
-  for (int i= 0; i < numRows; i++) {
-    for (int j= 0; j < numCols; j++) {
-      int i_start= i * size;
-      int j_start= j * size;
-      int i_end= std::min(this->myHeight, (i+1) * size);
-      int j_end= std::min(this->myWidth,  (j+1) * size);
+  // draw every cell's jitter up front, in cell order, so the
+  // colors don't depend on which thread gets to a cell first
+  std::vector<int> jitters(numRows * numCols * NUM_CHANNELS);
+  for (int& jitter: jitters) {
+    jitter= std::rand() % 80 - 40;
+  }
 
-      int redJitter= std::rand() % 80 - 40;
-      int greenJitter= std::rand() % 80 - 40;
-      int blueJitter= std::rand() % 80 - 40;
-      for (int row= i_start; row < i_end; row++) {
-        for (int col= j_start; col < j_end; col++) {
-          Pixel pixel= this->get(row, col);
-          pixel.r= clamp(pixel.r + redJitter, 0, 255);
-          pixel.g= clamp(pixel.g + greenJitter, 0, 255);
-          pixel.b= clamp(pixel.b + blueJitter, 0, 255);
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    for (int row= begin; row < end; row++) {
+      for (int col= 0; col < this->myWidth; col++) {
+        const int* jitter= &jitters[((row / size) * numCols + col / size) * NUM_CHANNELS];
+        Pixel pixel= this->get(row, col);
+        pixel.r= clamp(pixel.r + jitter[RED], 0, 255);
+        pixel.g= clamp(pixel.g + jitter[GREEN], 0, 255);
+        pixel.b= clamp(pixel.b + jitter[BLUE], 0, 255);
 
-          image.set(row, col, pixel);
-        }
+        image.set(row, col, pixel);
       }
     }
-  }
+  });
 
- 
   return image;
 }
 
@@ -542,7 +1054,8 @@ Image Image::bitmap(int size) const {
   int numCols= this->myWidth  / size + ((this->myWidth  % size != 0) ? 1 : 0);
   int numRows= this->myHeight / size + ((this->myHeight % size != 0) ? 1 : 0);
 
-  for (int i= 0; i < numRows; i++) {
+  // each cell row writes its own pixel rows
+  ThreadPool::shared().parallelFor(numRows, [&](int i) {
     for (int j= 0; j < numCols; j++) {
       int i_start= i * size;
       int j_start= j * size;
@@ -577,7 +1090,7 @@ Image Image::bitmap(int size) const {
       }
 
     }
-  }
+  });
 
 
   return image;
@@ -604,27 +1117,64 @@ Image Image::identity() const {
 }
 
 Image Image::gaussianBlur() const {
-  int kernel[] {1, 2, 1,
-                2, 4, 2,
-                1, 2, 1};
-  float scale= 1.0f/16.0f;
+  // the 3x3 kernel {1, 2, 1, 2, 4, 2, 1, 2, 1} / 16 is {1, 2, 1} / 4 twice
+  const int quarter= BLUR_WEIGHT_ONE / 4;
+  std::vector<int> weights {quarter, 2 * quarter, quarter};
 
-  Image result= this->convolute(kernel, scale, 3);
+  Image result(this->myWidth, this->myHeight);
+  separableBlur(this->myData, result.myData, this->myWidth, this->myHeight, weights);
+  return result;
+}
 
+Image Image::gaussianBlur(float sigma) const {
+  Image result(this->myWidth, this->myHeight);
+  this->gaussianBlur(sigma, result);
   return result;
 }
 
-Image Image::boxBlur() const {
-  int kernel[] {1, 1, 1,
-                1, 1, 1,
-                1, 1, 1};
-  float scale= 1.0f/9.0f;
+void Image::gaussianBlur(float sigma, Image& dst) const {
+  if (&dst == this) {
+    dst= this->gaussianBlur(sigma);
+    return;
+  }
+  dst._reshape(this->myWidth, this->myHeight);
+  if (sigma <= 0) {
+    std::memcpy(dst.myData, this->myData, this->totalBytes);
+    return;
+  }
+  separableBlur(this->myData, dst.myData, this->myWidth, this->myHeight, 
+    gaussianWeights(sigma));
+}
 
-  Image result= this->convolute(kernel, scale, 3);
+Image Image::boxBlur() const {
+  return this->boxBlur(1);
+}
 
+Image Image::boxBlur(int radius) const {
+  Image result(this->myWidth, this->myHeight);
+  this->boxBlur(radius, result);
   return result;
 }
 
+void Image::boxBlur(int radius, Image& dst) const {
+  if (&dst == this) {
+    dst= this->boxBlur(radius);
+    return;
+  }
+  dst._reshape(this->myWidth, this->myHeight);
+  if (radius <= 0) {
+    std::memcpy(dst.myData, this->myData, this->totalBytes);
+    return;
+  }
+  // one band per thread, each band starts by summing 2*radius+1 rows
+  ThreadPool& pool= ThreadPool::shared();
+  int numBands= pool.threadCount();
+  pool.parallelFor(numBands, [&](int band) {
+    slidingBoxBlur(this->myData, dst.myData, this->myWidth, this->myHeight, radius, 
+      band * this->myHeight / numBands, (band + 1) * this->myHeight / numBands);
+  });
+}
+
 Image Image::ridgeDetection() const {
   int kernel[] {-1, -1, -1, -1, 8, -1, -1, -1, -1};
 
@@ -646,91 +1196,74 @@ Image Image::unsharpMasking() const {
 }
 
 Image Image::sobel() const {
-  int kernel1[] {-1, 0, 1,
-                  -2, 0, 2,
-                  -1, 0, 1};
-  int kernel2[] {1, 2, 1,
-                 0, 0, 0,
-                 -1, -2, -1};
-      
-  Image G1= this->convolute(kernel1, 1, 3);
-  Image G2= this->convolute(kernel2, 1, 3);
-
   Image result(this->myWidth, this->myHeight);
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    sobelRows(this->myData, result.myData, nullptr, this->myWidth, this->myHeight, 
+      begin, end);
+  });
+  return result;
+}
 
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel1= G1.get(i);
-    Pixel pixel2= G2.get(i);
-
-    unsigned char r= clamp(std::sqrt((float) pixel1.r * (float) pixel1.r + (float) pixel2.r * (float) pixel2.r), 0, 255);
-    unsigned char g= clamp(std::sqrt((float) pixel1.g * (float) pixel1.g + (float) pixel2.g * (float) pixel2.g), 0, 255);
-    unsigned char b= clamp(std::sqrt((float) pixel1.b * (float) pixel1.b + (float) pixel2.b * (float) pixel2.b), 0, 255);
-
-    result.set(i, Pixel{r, g, b});
+void Image::sobel(Image& magnitude, Image& orientation) const {
+  // the pass reads the neighbors of each pixel, so it can't write over them
+  if (&magnitude == this || &orientation == this) {
+    Image source= *this;
+    source.sobel(magnitude, orientation);
+    return;
   }
-  
-  return result;
+  magnitude._reshape(this->myWidth, this->myHeight);
+  orientation._reshape(this->myWidth, this->myHeight);
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    sobelRows(this->myData, magnitude.myData, orientation.myData, 
+      this->myWidth, this->myHeight, begin, end);
+  });
 }
 
 Image Image::extract(const Pixel& low, const Pixel& high) const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
-    if (pixel.r < low.r || pixel.g < low.g || pixel.b < low.b ||
-        pixel.r > high.r || pixel.g > high.g || pixel.b > high.b) {
-      pixel.r= 0;
-      pixel.g= 0;
-      pixel.b= 0;
-    }
-    result.set(i, pixel);
-  }
-
+  this->extract(low, high, result);
   return result;
 }
 
+void Image::extract(const Pixel& low, const Pixel& high, Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, 
+    ExtractOp {low, high});
+}
+
 Image Image::extractRed() const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
-    pixel.g= 0;
-    pixel.b= 0;
-    
-    result.set(i, pixel);
-  }
-
+  this->extractRed(result);
   return result;
 }
 
+void Image::extractRed(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, ChannelOp {RED});
+}
+
 Image Image::extractGreen() const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
-    pixel.r= 0;
-    pixel.b= 0;
-    
-    result.set(i, pixel);
-  }
-
+  this->extractGreen(result);
   return result;
 }
 
+void Image::extractGreen(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, ChannelOp {GREEN});
+}
+
 Image Image::extractBlue() const {
   Image result(this->myWidth, this->myHeight);
-
-  for (int i= 0; i < this->totalPixels; i++) {
-    Pixel pixel= this->get(i);
-    pixel.r= 0;
-    pixel.g= 0;
-    
-    result.set(i, pixel);
-  }
-
+  this->extractBlue(result);
   return result;
 }
 
+void Image::extractBlue(Image& dst) const {
+  dst._reshape(this->myWidth, this->myHeight);
+  pointwise(this->myData, dst.myData, this->myWidth, this->myHeight, ChannelOp {BLUE});
+}
+
 Image Image::gridCopy(int m, int n) const {
   Image result(this->myWidth * n, this->myHeight * m);
   unsigned char* data= result.data();
@@ -740,12 +1273,14 @@ Image Image::gridCopy(int m, int n) const {
   // this iterates row-by-row of our current image
   // and copies the bytes directly over to each grid cell
   // in result
-  for (int i= 0; i < m * this->myHeight; i++) {
-    for (int j= 0; j < n; j++) {
-      memcpy(data + (i * n * widthBytes + j * widthBytes), this->myData + 
-        (i % this->myHeight * widthBytes), widthBytes);
+  ThreadPool::shared().parallelRows(m * this->myHeight, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      for (int j= 0; j < n; j++) {
+        memcpy(data + (i * n * widthBytes + j * widthBytes), this->myData + 
+          (i % this->myHeight * widthBytes), widthBytes);
+      }
     }
-  }
+  });
 
   return result;
 }
@@ -760,48 +1295,61 @@ void Image::inImageCheck(int row, int col) const {
 Image Image::convolute(int kernel[], float kernelScale, int sideLength) const {
   Image result(this->myWidth, this->myHeight);
 
-  for (int i= 0; i < this->myHeight; i++) {
-    for (int j= 0; j < this->myWidth; j++) {
-      Pixel accumulator= {0, 0, 0};
-      float accumulatorRed= 0;
-      float accumulatorGreen= 0;
-      float accumulatorBlue= 0;
-
-      // convolute operator
-      for (int k_i= 0; k_i < sideLength; k_i++) {
-        for (int k_j= 0; k_j < sideLength; k_j++) {
-          int i_offset= k_i - 1; // so we get -1, 0, or 1
-          int j_offset= k_j - 1;
-
-          int pixel_i= clamp(i + i_offset, 0, this->myHeight - 1);
-          int pixel_j= clamp(j + j_offset, 0, this->myWidth - 1);
-
-
-          Pixel pixel= this->get(pixel_i, pixel_j);
+  // integer kernels scaled by n / 2^s take the fixed point (SIMD) path,
+  // which gives the same bytes as the float sums below
+  FixedKernel fixed;
+  if (makeFixedKernel(kernel, kernelScale, sideLength, fixed)) {
+    convolveFixed(this->myData, result.myData, this->myWidth, this->myHeight, fixed);
+    return result;
+  }
 
-          // convolution operator requires us to multiply the index
-          // mirrored to the pixel aka (m-i-1, n-j-1)
-          int kernel_idx= (sideLength - 1 - k_i) * sideLength + (sideLength - 1 - k_j);
-          accumulatorRed += kernelScale * kernel[kernel_idx] * pixel.r;
-          accumulatorGreen += kernelScale * kernel[kernel_idx] * pixel.g;
-          accumulatorBlue += kernelScale * kernel[kernel_idx] * pixel.b;
+  ThreadPool::shared().parallelRows(this->myHeight, [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      for (int j= 0; j < this->myWidth; j++) {
+        Pixel accumulator= {0, 0, 0};
+        float accumulatorRed= 0;
+        float accumulatorGreen= 0;
+        float accumulatorBlue= 0;
+
+        // convolute operator
+        for (int k_i= 0; k_i < sideLength; k_i++) {
+          for (int k_j= 0; k_j < sideLength; k_j++) {
+            // so we get -1, 0, or 1 for 3x3 kernels, -2 to 2 for 5x5
+            int i_offset= k_i - sideLength / 2;
+            int j_offset= k_j - sideLength / 2;
+
+            int pixel_i= clamp(i + i_offset, 0, this->myHeight - 1);
+            int pixel_j= clamp(j + j_offset, 0, this->myWidth - 1);
+
+
+            Pixel pixel= this->get(pixel_i, pixel_j);
+
+            // convolution operator requires us to multiply the index
+            // mirrored to the pixel aka (m-i-1, n-j-1)
+            int kernel_idx= (sideLength - 1 - k_i) * sideLength + (sideLength - 1 - k_j);
+            accumulatorRed += kernelScale * kernel[kernel_idx] * pixel.r;
+            accumulatorGreen += kernelScale * kernel[kernel_idx] * pixel.g;
+            accumulatorBlue += kernelScale * kernel[kernel_idx] * pixel.b;
+          }
         }
-      }
 
-      accumulator.r= clamp(accumulatorRed, 0, 255);
-      accumulator.g= clamp(accumulatorGreen, 0, 255);
-      accumulator.b= clamp(accumulatorBlue, 0, 255);
-      
-      result.set(i, j, accumulator);
+        accumulator.r= clamp(accumulatorRed, 0, 255);
+        accumulator.g= clamp(accumulatorGreen, 0, 255);
+        accumulator.b= clamp(accumulatorBlue, 0, 255);
+        
+        result.set(i, j, accumulator);
 
+      }
     }
-  }
+  });
 
   return result;
 }
 
 Image Image::glow(const Pixel& low, const Pixel& high) const {
-  return this->add(this->extract(low, high).boxBlur());
+  // fused into one pass, the extracted and blurred rows never leave cache
+  ImageExpr source(*this);
+  return source.add(source.extract(low, high).boxBlur(1)).eval();
 }
 
 
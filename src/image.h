@@ -5,11 +5,14 @@
 #ifndef AGL_IMAGE_H_
 #define AGL_IMAGE_H_
 
+#include <cstddef>
 #include <iostream>
 #include <string>
 
 namespace agl {
 
+class ChannelLUT;
+
 /**
  * @brief Holder for a RGB color
  * 
@@ -20,6 +23,11 @@ struct Pixel {
   unsigned char b;
 };
 
+// How resize computes the new pixels, from fastest to sharpest.
+// AREA averages the pixels under each new one, weighted by how much
+// of each it covers
+enum ResampleFilter { NEAREST, BILINEAR, AREA, LANCZOS3 };
+
 /**
  * @brief Implements loading, modifying, and saving RGB images
  */
@@ -30,10 +38,16 @@ class Image {
   Image(const Image& orig);
   Image& operator=(const Image& orig);
 
+  // Moving takes over the pixel buffer and leaves orig empty
+  Image(Image&& orig) noexcept;
+  Image& operator=(Image&& orig) noexcept;
+
   virtual ~Image();
 
   /** 
-   * @brief Load the given filename 
+   * @brief Load the given filename (PNG, JPG, BMP, PPM, QOI, TGA, ...).
+   * A .raw file is mapped instead of read, its pages load as they are
+   * first touched and edits copy them without changing the file
    * @param filename The file to load, relative to the running directory
    * @param flip Whether the file should flipped vertically when loaded
    * 
@@ -41,12 +55,34 @@ class Image {
    */
   bool load(const std::string& filename, bool flip = false);
 
+  /**
+   * @brief Load the given filename into this image's own buffer, without
+   * allocating a new one. Fails, leaving the image as it was, unless the
+   * file is the same size as the image. A file that turns out to be
+   * corrupt may leave the pixels partly overwritten
+   * @param filename The file to load, relative to the running directory
+   */
+  bool loadInto(const std::string& filename);
+
+  /**
+   * @brief Read only the header of the given filename for its size
+   * @param filename The file to look at, relative to the running directory
+   * @param width Set to the image width in pixels
+   * @param height Set to the image height in pixels
+   * @return Whether the file is an image load can read
+   */
+  static bool probe(const std::string& filename, int& width, int& height);
+
   /** 
-   * @brief Save the image to the given filename (.png)
+   * @brief Save the image to the given filename, as PNG unless the
+   * extension is .ppm, .pnm, .bmp, .qoi, .jpg, .jpeg or .raw
    * @param filename The file to load, relative to the running directory
    * @param flip Whether the file should flipped vertally before being saved
+   * @param level PNG compression from 0 (fastest, largest) to 9 (slowest, smallest)
+   * @param quality JPG quality from 1 to 100
    */
-  bool save(const std::string& filename, bool flip = true) const;
+  bool save(const std::string& filename, bool flip = false, int level = 6,
+    int quality = 90) const;
 
   /** @brief Return the image width in pixels
    */
@@ -59,7 +95,8 @@ class Image {
   /** 
    * @brief Return the RGB data
    *
-   * Data will have size width * height * 4 (RGB)
+   * Data will have size width * height * 3 (RGB) and starts
+   * on a 64 byte boundary
    */
   unsigned char* data() const;
 
@@ -121,19 +158,36 @@ class Image {
  */
   void set(int i, const Pixel& c);
 
-  // resize the image
-  Image resize(int width, int height) const;
+  // resize the image, nearest neighbor unless another filter is given
+  Image resize(int width, int height, ResampleFilter filter = NEAREST) const;
+  void resize(int width, int height, ResampleFilter filter, Image& dst) const;
+
+  // The flips and rotations also come with an overload that writes 
+  // into dst, which is resized to match and may be this image itself
 
   // flip around the horizontal midline
   Image flipHorizontal() const;
+  void flipHorizontal(Image& dst) const;
 
   // flip around the vertical midline
   Image flipVertical() const;
+  void flipVertical(Image& dst) const;
 
+  // mirror across the diagonal from the top left, (x, y) goes to (y, x)
   Image flipPositiveDiagonal() const;
+  void flipPositiveDiagonal(Image& dst) const;
 
-  // rotate the Image 90 degrees
+  // rotate the Image 90 degrees clockwise
   Image rotate90() const;
+  void rotate90(Image& dst) const;
+
+  // rotate the Image 180 degrees
+  Image rotate180() const;
+  void rotate180(Image& dst) const;
+
+  // rotate the Image 90 degrees counterclockwise
+  Image rotate270() const;
+  void rotate270(Image& dst) const;
 
   // Return a sub-Image having the given top,left coordinate and (width, height)
   Image subimage(int x, int y, int w, int h) const;
@@ -145,59 +199,79 @@ class Image {
   // starting from the top left is (0, 0)
   void replace(const Image& image, int startx, int starty);
 
+  // The pointwise filters below also come with an overload that
+  // writes the result into dst instead of a new image. dst is resized
+  // to match if needed and may be this image (or other) itself
+
   // swirl the colors 
   Image swirl() const;
+  void swirl(Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = this.pixel + other.pixel
   // Assumes that the two images are the same size
   Image add(const Image& other) const;
+  void add(const Image& other, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = this.pixel - other.pixel
   // Assumes that the two images are the same size
   Image subtract(const Image& other) const;
+  void subtract(const Image& other, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = this.pixel * other.pixel
   // Assumes that the two images are the same size
   Image multiply(const Image& other) const;
+  void multiply(const Image& other, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = abs(this.pixel - other.pixel)
   // Assumes that the two images are the same size
   Image difference(const Image& other) const;
+  void difference(const Image& other, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = max(this.pixel, other.pixel)
   // Assumes that the two images are the same size
   Image lightest(const Image& other) const;
+  void lightest(const Image& other, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    result.pixel = min(this.pixel, other.pixel)
   // Assumes that the two images are the same size
   Image darkest(const Image& other) const;
+  void darkest(const Image& other, Image& dst) const;
 
   // Apply gamma correction
   Image gammaCorrect(float gamma) const;
+  void gammaCorrect(float gamma, Image& dst) const;
+
+  // Map every channel through its table in lut, e.g. a chain of
+  // tone curves composed into one ChannelLUT
+  Image applyLUT(const ChannelLUT& lut) const;
+  void applyLUT(const ChannelLUT& lut, Image& dst) const;
 
   // Apply the following calculation to the pixels in 
   // our image and the given image:
   //    this.pixels = this.pixels * (1-alpha) + other.pixel * alpha
   // Assumes that the two images are the same size
   Image alphaBlend(const Image& other, float amount) const;
+  void alphaBlend(const Image& other, float amount, Image& dst) const;
 
   // Convert the image to grayscale
   Image invert() const;
+  void invert(Image& dst) const;
 
   // Convert the image to grayscale
   Image grayscale() const;
+  void grayscale(Image& dst) const;
 
   // Jitters the colors
   // Parameter size is the size x size cell we 
@@ -231,30 +305,48 @@ class Image {
   // Applies a 3x3 Gaussian Blur
   Image gaussianBlur() const;
 
-  // Applies a Box Blur
+  // Applies a Gaussian Blur with standard deviation sigma (in pixels),
+  // the kernel reaches 3 sigma to each side
+  Image gaussianBlur(float sigma) const;
+  void gaussianBlur(float sigma, Image& dst) const;
+
+  // Applies a 3x3 Box Blur
   Image boxBlur() const;
 
+  // Applies a Box Blur over the (2*radius+1) x (2*radius+1) square
+  // around each pixel, it costs the same for any radius
+  Image boxBlur(int radius) const;
+  void boxBlur(int radius, Image& dst) const;
+
   // Ridge Detection
   Image ridgeDetection() const;
 
   // Unsharp Masking
   Image unsharpMasking() const;
 
-  // Sobel operator
+  // Sobel operator, the gradient magnitude of each channel
   Image sobel() const;
 
+  // Sobel operator that also writes each channel's gradient direction,
+  // atan2(gy, gx) mapped from [-pi, pi] to [0, 255], into orientation
+  void sobel(Image& magnitude, Image& orientation) const;
+
   // Extract all pixels that have values above the low pixel's rgb values
   // and below the high pixel's rgb values (all channels must be between those values)
   Image extract(const Pixel& low, const Pixel& high) const;
+  void extract(const Pixel& low, const Pixel& high, Image& dst) const;
 
   // Extract red channel 
   Image extractRed() const;
+  void extractRed(Image& dst) const;
 
   // Extract green channel
   Image extractGreen() const;
+  void extractGreen(Image& dst) const;
 
   // Extract blue channel
   Image extractBlue() const;
+  void extractBlue(Image& dst) const;
 
   // GridCopy will copy the current image and paste it in a m x n grid
   Image gridCopy(int m, int n) const;
@@ -275,11 +367,25 @@ class Image {
   void alphaColor(int x, int y, Pixel p, float alpha);
 
   private:
+    // Hands the pixel buffer back to the ImagePool, or unmaps it
+    void _releaseData();
+
+    // Makes sure the image has a width x height buffer, keeping
+    // the current one (and its contents) if it already fits
+    void _reshape(int width, int height);
+
+    // Writes the transpose into dst, then reverses dst's rows and/or
+    // columns, which gives the diagonal flip and the quarter turns
+    void _transposeInto(Image& dst, bool reverseRows, bool reverseColumns) const;
+
     int myWidth;
     int myHeight;
     unsigned char* myData;
     int totalBytes;
     int totalPixels;
+    // set when myData points into a mapped RAW file
+    void* myMapping;
+    size_t myMappedBytes;
 };
 }  // namespace agl
 #endif  // AGL_IMAGE_H_
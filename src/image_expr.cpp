@@ -0,0 +1,399 @@
+#include "image_expr.h"
+#include "image_kernels.h"
+#include "pixel_ops.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+using namespace agl;
+
+/**
+ * eval() splits the output into strips of rows. For each strip it first
+ * works out which rows every node has to produce: a node passes its rows
+ * on to its inputs, and a stencil widens them by its radius (clamped to
+ * the image). Then each node is computed once into a strip sized buffer,
+ * sources are read in place. Since a stencil's input buffer holds all
+ * the rows it reads and starts at row 0 or ends at the last row only
+ * when the image does, running the kernel over the buffer as if it were
+ * the whole image clamps exactly where the full filter would.
+*/
+
+const int PIXEL_BYTES= 3;
+
+struct agl::ExprNode {
+  enum Kind { SOURCE, POINTWISE, BINARY, STENCIL };
+
+  Kind kind;
+  int width;
+  int height;
+  const Image* image= nullptr;          // SOURCE
+  std::vector<ImageExpr::RowOp> ops;    // POINTWISE, fused, applied in order
+  ImageExpr::BinaryRowOp combine;       // BINARY
+  ImageExpr::StencilOp stencil;         // STENCIL
+  int radius= 0;                        // rows a STENCIL reads above and below
+  int reach= 0;                         // radius summed down the deepest path
+  std::shared_ptr<const ExprNode> a;
+  std::shared_ptr<const ExprNode> b;
+};
+
+// Wraps a pixel_ops functor into a function over a run of pixels
+template <class Op>
+auto rowOp(const Op& op)
+{
+  return [op](const unsigned char* in, unsigned char* out, int pixels) {
+    for (int i= 0; i < pixels * PIXEL_BYTES; i+= PIXEL_BYTES) {
+      op(in + i, out + i);
+    }
+  };
+}
+
+template <class Op>
+auto binaryRowOp(const Op& op)
+{
+  return [op](const unsigned char* a, const unsigned char* b,
+    unsigned char* out, int pixels) {
+    for (int i= 0; i < pixels * PIXEL_BYTES; i+= PIXEL_BYTES) {
+      op(a + i, b + i, out + i);
+    }
+  };
+}
+
+// The rows [begin, end) of a node's output within one strip
+struct NodeRows {
+  int begin;
+  int end;
+  const unsigned char* data= nullptr;  // row begin, null until computed
+  std::unique_ptr<unsigned char[]> storage;
+};
+
+class StripEvaluator
+{
+public:
+  // Notes that the rows [begin, end) of node are needed
+  void require(const ExprNode* node, int begin, int end)
+  {
+    auto found= this->myRows.find(node);
+    if (found != this->myRows.end()) {
+      NodeRows& rows= found->second;
+      if (rows.begin <= begin && end <= rows.end) return;
+      begin= std::min(begin, rows.begin);
+      end= std::max(end, rows.end);
+    }
+    NodeRows& rows= this->myRows[node];
+    rows.begin= begin;
+    rows.end= end;
+
+    int inBegin= std::max(begin - node->radius, 0);
+    int inEnd= std::min(end + node->radius, node->height);
+    if (node->a) this->require(node->a.get(), inBegin, inEnd);
+    if (node->b) this->require(node->b.get(), inBegin, inEnd);
+  }
+
+  // Computes the required rows of node into target, whose first row is
+  // the first required row
+  void write(const ExprNode* node, unsigned char* target)
+  {
+    NodeRows& rows= this->myRows[node];
+    bool direct= node->kind == ExprNode::POINTWISE || node->kind == ExprNode::BINARY;
+    const unsigned char* data= this->_compute(node, direct ? target : nullptr);
+    if (data != target) {
+      std::memcpy(target, data,
+        (size_t) (rows.end - rows.begin) * node->width * PIXEL_BYTES);
+    }
+  }
+
+private:
+  // The required rows of node starting at row y
+  const unsigned char* _rowsFrom(const ExprNode* node, int y)
+  {
+    const unsigned char* data= this->_compute(node, nullptr);
+    return data + (size_t) (y - this->myRows[node].begin) * node->width * PIXEL_BYTES;
+  }
+
+  // Computes the required rows of node, into target when it isn't null
+  const unsigned char* _compute(const ExprNode* node, unsigned char* target)
+  {
+    NodeRows& rows= this->myRows[node];
+    if (rows.data) return rows.data;
+
+    const int width= node->width;
+    const int rowBytes= width * PIXEL_BYTES;
+    const int numRows= rows.end - rows.begin;
+
+    if (node->kind == ExprNode::SOURCE) {
+      rows.data= node->image->data() + (size_t) rows.begin * rowBytes;
+      return rows.data;
+    }
+
+    if (node->kind == ExprNode::STENCIL) {
+      // the kernel sees the input's rows as a whole image, our rows
+      // sit at the same offset in the output
+      const NodeRows& in= this->myRows[node->a.get()];
+      const unsigned char* src= this->_compute(node->a.get(), nullptr);
+      int offset= rows.begin - in.begin;
+      rows.storage.reset(new unsigned char[(size_t) (rows.end - in.begin) * rowBytes]);
+      node->stencil(src, rows.storage.get(), width, in.end - in.begin,
+        offset, offset + numRows);
+      rows.data= rows.storage.get() + (size_t) offset * rowBytes;
+      return rows.data;
+    }
+
+    unsigned char* out= target;
+    if (out == nullptr) {
+      rows.storage.reset(new unsigned char[(size_t) numRows * rowBytes]);
+      out= rows.storage.get();
+    }
+
+    if (node->kind == ExprNode::POINTWISE) {
+      // the whole chain runs over one row while it's in L1
+      const unsigned char* in= this->_rowsFrom(node->a.get(), rows.begin);
+      for (int y= 0; y < numRows; y++) {
+        unsigned char* row= out + (size_t) y * rowBytes;
+        node->ops[0](in + (size_t) y * rowBytes, row, width);
+        for (size_t k= 1; k < node->ops.size(); k++) {
+          node->ops[k](row, row, width);
+        }
+      }
+    } else {
+      const unsigned char* a= this->_rowsFrom(node->a.get(), rows.begin);
+      const unsigned char* b= this->_rowsFrom(node->b.get(), rows.begin);
+      for (int y= 0; y < numRows; y++) {
+        size_t at= (size_t) y * rowBytes;
+        node->combine(a + at, b + at, out + at, width);
+      }
+    }
+    rows.data= out;
+    return rows.data;
+  }
+
+  std::unordered_map<const ExprNode*, NodeRows> myRows;
+};
+
+// Whether node or anything below it reads image
+bool readsImage(const ExprNode* node, const Image* image)
+{
+  if (node->kind == ExprNode::SOURCE) return node->image == image;
+  return (node->a && readsImage(node->a.get(), image)) ||
+    (node->b && readsImage(node->b.get(), image));
+}
+
+ImageExpr::ImageExpr(const Image& image)
+{
+  std::shared_ptr<ExprNode> node= std::make_shared<ExprNode>();
+  node->kind= ExprNode::SOURCE;
+  node->width= image.width();
+  node->height= image.height();
+  node->image= &image;
+  this->myNode= node;
+}
+
+ImageExpr::ImageExpr(const std::shared_ptr<const ExprNode>& node) : myNode(node)
+{
+}
+
+int ImageExpr::width() const
+{
+  return this->myNode->width;
+}
+
+int ImageExpr::height() const
+{
+  return this->myNode->height;
+}
+
+ImageExpr ImageExpr::_pointwise(const RowOp& op) const
+{
+  std::shared_ptr<ExprNode> node= std::make_shared<ExprNode>();
+  if (this->myNode->kind == ExprNode::POINTWISE) {
+    // extends a copy of the chain, so if the shorter chain is used
+    // elsewhere too it gets computed twice, which is cheap next to
+    // another pass over memory
+    *node= *this->myNode;
+    node->ops.push_back(op);
+  } else {
+    node->kind= ExprNode::POINTWISE;
+    node->width= this->width();
+    node->height= this->height();
+    node->ops.push_back(op);
+    node->reach= this->myNode->reach;
+    node->a= this->myNode;
+  }
+  return ImageExpr(node);
+}
+
+ImageExpr ImageExpr::_binary(const ImageExpr& other, const BinaryRowOp& op) const
+{
+  assert(this->width() == other.width() && this->height() == other.height());
+  std::shared_ptr<ExprNode> node= std::make_shared<ExprNode>();
+  node->kind= ExprNode::BINARY;
+  node->width= this->width();
+  node->height= this->height();
+  node->combine= op;
+  node->reach= std::max(this->myNode->reach, other.myNode->reach);
+  node->a= this->myNode;
+  node->b= other.myNode;
+  return ImageExpr(node);
+}
+
+ImageExpr ImageExpr::_stencil(int radius, const StencilOp& op) const
+{
+  std::shared_ptr<ExprNode> node= std::make_shared<ExprNode>();
+  node->kind= ExprNode::STENCIL;
+  node->width= this->width();
+  node->height= this->height();
+  node->stencil= op;
+  node->radius= radius;
+  node->reach= this->myNode->reach + radius;
+  node->a= this->myNode;
+  return ImageExpr(node);
+}
+
+ImageExpr ImageExpr::invert() const
+{
+  return this->_pointwise(rowOp(InvertOp()));
+}
+
+ImageExpr ImageExpr::grayscale() const
+{
+  return this->_pointwise(rowOp(GrayscaleOp()));
+}
+
+ImageExpr ImageExpr::gammaCorrect(float gamma) const
+{
+  return this->applyLUT(ChannelLUT().gamma(gamma));
+}
+
+ImageExpr ImageExpr::applyLUT(const ChannelLUT& lut) const
+{
+  return this->_pointwise([lut](const unsigned char* in, unsigned char* out,
+    int pixels) {
+    lut.apply(in, out, pixels);
+  });
+}
+
+ImageExpr ImageExpr::swirl() const
+{
+  return this->_pointwise(rowOp(SwirlOp()));
+}
+
+ImageExpr ImageExpr::extract(const Pixel& low, const Pixel& high) const
+{
+  return this->_pointwise(rowOp(ExtractOp {low, high}));
+}
+
+ImageExpr ImageExpr::extractRed() const
+{
+  return this->_pointwise(rowOp(ChannelOp {0}));
+}
+
+ImageExpr ImageExpr::extractGreen() const
+{
+  return this->_pointwise(rowOp(ChannelOp {1}));
+}
+
+ImageExpr ImageExpr::extractBlue() const
+{
+  return this->_pointwise(rowOp(ChannelOp {2}));
+}
+
+ImageExpr ImageExpr::add(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(AddOp()));
+}
+
+ImageExpr ImageExpr::subtract(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(SubtractOp()));
+}
+
+ImageExpr ImageExpr::multiply(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(MultiplyOp()));
+}
+
+ImageExpr ImageExpr::difference(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(DifferenceOp()));
+}
+
+ImageExpr ImageExpr::lightest(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(LightestOp()));
+}
+
+ImageExpr ImageExpr::darkest(const ImageExpr& other) const
+{
+  return this->_binary(other, binaryRowOp(DarkestOp()));
+}
+
+ImageExpr ImageExpr::alphaBlend(const ImageExpr& other, float amount) const
+{
+  return this->_binary(other, binaryRowOp(AlphaBlendOp {amount}));
+}
+
+ImageExpr ImageExpr::boxBlur(int radius) const
+{
+  if (radius <= 0) return *this;
+  return this->_stencil(radius, [radius](const unsigned char* src,
+    unsigned char* dst, int width, int height, int yBegin, int yEnd) {
+    slidingBoxBlur(src, dst, width, height, radius, yBegin, yEnd);
+  });
+}
+
+ImageExpr ImageExpr::gaussianBlur(float sigma) const
+{
+  if (sigma <= 0) return *this;
+  std::vector<int> weights= gaussianWeights(sigma);
+  return this->_stencil(weights.size() / 2, [weights](const unsigned char* src,
+    unsigned char* dst, int width, int height, int yBegin, int yEnd) {
+    separableBlurRows(src, dst, width, height, weights, yBegin, yEnd);
+  });
+}
+
+ImageExpr ImageExpr::sobel() const
+{
+  return this->_stencil(1, [](const unsigned char* src, unsigned char* dst,
+    int width, int height, int yBegin, int yEnd) {
+    sobelRows(src, dst, nullptr, width, height, yBegin, yEnd);
+  });
+}
+
+Image ImageExpr::eval() const
+{
+  Image result(this->width(), this->height());
+  this->eval(result);
+  return result;
+}
+
+void ImageExpr::eval(Image& dst) const
+{
+  // strips are written while others still read their halos
+  if (readsImage(this->myNode.get(), &dst)) {
+    dst= this->eval();
+    return;
+  }
+
+  const int width= this->width();
+  const int height= this->height();
+  if (dst.width() != width || dst.height() != height) {
+    dst= Image(width, height);
+  }
+  if (width == 0 || height == 0) return;
+
+  // each strip recomputes the halo rows around it, so the strips are
+  // made tall enough that the halos stay a small part of the work
+  ThreadPool& pool= ThreadPool::shared();
+  int strip= std::max(pool.rowGrain(), 4 * this->myNode->reach);
+  int numStrips= (height + strip - 1) / strip;
+  const ExprNode* root= this->myNode.get();
+
+  pool.parallelFor(numStrips, [&](int i) {
+    int begin= i * strip;
+    int end= std::min(begin + strip, height);
+    StripEvaluator evaluator;
+    evaluator.require(root, begin, end);
+    evaluator.write(root, dst.data() + (size_t) begin * width * PIXEL_BYTES);
+  });
+}
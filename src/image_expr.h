@@ -0,0 +1,84 @@
+/*-----------------------------------------------
+ * Description: Lazy image expressions. An ImageExpr
+ * records Image filters as a DAG and runs nothing
+ * until eval(), which computes the result a strip
+ * of rows at a time. Chains of pointwise filters
+ * are fused into one pass over each row, and the
+ * stencils (blurs, sobel) pull just the rows they
+ * need, halo included, from their input, so the
+ * intermediates stay in cache instead of each
+ * filling a whole frame.
+ ----------------------------------------------*/
+
+#ifndef image_expr_H_
+#define image_expr_H_
+
+#include "channel_lut.h"
+#include "image.h"
+#include <functional>
+#include <memory>
+
+namespace agl
+{
+  struct ExprNode;
+
+  class ImageExpr
+  {
+  public:
+    // An expression that reads image. The image isn't copied, so it
+    // has to outlive the expression and not change before eval()
+    ImageExpr(const Image& image);
+
+    int width() const;
+    int height() const;
+
+    // Pointwise filters, they match the Image methods of the same name.
+    // A filter applied to a pointwise expression joins its chain
+    ImageExpr invert() const;
+    ImageExpr grayscale() const;
+    ImageExpr gammaCorrect(float gamma) const;
+    ImageExpr applyLUT(const ChannelLUT& lut) const;
+    ImageExpr swirl() const;
+    ImageExpr extract(const Pixel& low, const Pixel& high) const;
+    ImageExpr extractRed() const;
+    ImageExpr extractGreen() const;
+    ImageExpr extractBlue() const;
+
+    // Pointwise filters of two expressions of the same size
+    ImageExpr add(const ImageExpr& other) const;
+    ImageExpr subtract(const ImageExpr& other) const;
+    ImageExpr multiply(const ImageExpr& other) const;
+    ImageExpr difference(const ImageExpr& other) const;
+    ImageExpr lightest(const ImageExpr& other) const;
+    ImageExpr darkest(const ImageExpr& other) const;
+    ImageExpr alphaBlend(const ImageExpr& other, float amount) const;
+
+    // Stencil filters, each output row reads rows above and below it
+    ImageExpr boxBlur(int radius) const;
+    ImageExpr gaussianBlur(float sigma) const;
+    ImageExpr sobel() const;
+
+    // Computes the expression on the shared thread pool, one strip of
+    // rows per task. dst may be one of the images the expression reads
+    Image eval() const;
+    void eval(Image& dst) const;
+
+  private:
+    friend struct ExprNode;
+
+    typedef std::function<void(const unsigned char*, unsigned char*, int)> RowOp;
+    typedef std::function<void(const unsigned char*, const unsigned char*,
+      unsigned char*, int)> BinaryRowOp;
+    typedef std::function<void(const unsigned char*, unsigned char*,
+      int, int, int, int)> StencilOp;
+
+    ImageExpr(const std::shared_ptr<const ExprNode>& node);
+    ImageExpr _pointwise(const RowOp& op) const;
+    ImageExpr _binary(const ImageExpr& other, const BinaryRowOp& op) const;
+    ImageExpr _stencil(int radius, const StencilOp& op) const;
+
+    std::shared_ptr<const ExprNode> myNode;
+  };
+}
+
+#endif
@@ -0,0 +1,560 @@
+#include "image_formats.h"
+#include "image_pool.h"
+#include "png_writer.h"
+#include "stb/stb_image.h"
+#include "stb/stb_image_write.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace agl;
+
+/**
+ * PPM and BMP are a header and then the rows as they are, BMP's
+ * bottom up in blue, green, red order and padded to four bytes, so
+ * writing them costs little more than the copy. QOI codes each pixel
+ * against the one before it: a run of repeats, a slot in a 64 entry
+ * table of recently seen colors, a small difference or the color
+ * itself, in one pass with no search. JPG goes through stb. RAW is the
+ * rows after a fixed header, and its pixels start RAW_HEADER_BYTES into
+ * the file, so a page aligned mapping leaves them cache line aligned
+ * like every other Image buffer.
+*/
+
+const int CHANNELS= 3;
+
+// Rows are converted and written this many bytes at a time
+const int WRITE_BUFFER_BYTES= 1 << 16;
+
+const unsigned char QOI_OP_INDEX= 0x00;
+const unsigned char QOI_OP_DIFF= 0x40;
+const unsigned char QOI_OP_LUMA= 0x80;
+const unsigned char QOI_OP_RUN= 0xc0;
+const unsigned char QOI_OP_RGB= 0xfe;
+const unsigned char QOI_OP_RGBA= 0xff;
+const unsigned char QOI_MASK= 0xc0;
+const int QOI_HEADER_BYTES= 14;
+const int QOI_MAX_RUN= 62;
+const unsigned char QOI_END[8]= {0, 0, 0, 0, 0, 0, 0, 1};
+// QOI's own limit, which keeps the decoded size well inside an int
+const int64_t QOI_MAX_PIXELS= 400000000;
+
+const char RAW_MAGIC[8]= {'A', 'G', 'L', 'R', 'A', 'W', '0', '1'};
+
+ImageFormat agl::imageFormat(const std::string& filename)
+{
+  size_t dot= filename.find_last_of('.');
+  if (dot == std::string::npos) return PNG;
+
+  std::string extension= filename.substr(dot + 1);
+  for (size_t i= 0; i < extension.size(); i++) {
+    extension[i]= std::tolower((unsigned char) extension[i]);
+  }
+  if (extension == "ppm" || extension == "pnm") return PPM;
+  if (extension == "bmp") return BMP;
+  if (extension == "qoi") return QOI;
+  if (extension == "jpg" || extension == "jpeg") return JPG;
+  if (extension == "raw") return RAW;
+  return PNG;
+}
+
+void putLittleEndian(unsigned char* out, uint32_t value, int bytes)
+{
+  for (int i= 0; i < bytes; i++) out[i]= value >> (8 * i);
+}
+
+void putBigEndian(unsigned char* out, uint32_t value)
+{
+  out[0]= value >> 24;
+  out[1]= value >> 16;
+  out[2]= value >> 8;
+  out[3]= value;
+}
+
+uint32_t getBigEndian(const unsigned char* in)
+{
+  return (uint32_t) in[0] << 24 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 8 | in[3];
+}
+
+uint32_t getLittleEndian(const unsigned char* in)
+{
+  return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t) in[3] << 24;
+}
+
+bool agl::writePPM(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip)
+{
+  if (width <= 0 || height <= 0) return false;
+  FILE* file= fopen(filename.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  const size_t rowBytes= (size_t) width * CHANNELS;
+  bool ok= fprintf(file, "P6\n%d %d\n255\n", width, height) > 0;
+  if (!flip) {
+    ok= ok && fwrite(data, 1, rowBytes * height, file) == rowBytes * height;
+  }
+  else {
+    for (int y= height - 1; y >= 0 && ok; y--) {
+      ok= fwrite(data + y * rowBytes, 1, rowBytes, file) == rowBytes;
+    }
+  }
+
+  ok= fclose(file) == 0 && ok;
+  return ok;
+}
+
+bool agl::writeBMP(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip)
+{
+  if (width <= 0 || height <= 0) return false;
+  FILE* file= fopen(filename.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  const size_t rowBytes= (size_t) width * CHANNELS;
+  const size_t paddedBytes= (rowBytes + 3) & ~(size_t) 3;
+  const uint32_t imageBytes= paddedBytes * height;
+
+  // file header, then the 40 byte BITMAPINFOHEADER
+  unsigned char header[54]= {'B', 'M'};
+  putLittleEndian(header + 2, 54 + imageBytes, 4);
+  putLittleEndian(header + 10, 54, 4);
+  putLittleEndian(header + 14, 40, 4);
+  putLittleEndian(header + 18, width, 4);
+  putLittleEndian(header + 22, height, 4);
+  putLittleEndian(header + 26, 1, 2);          // planes
+  putLittleEndian(header + 28, 24, 2);         // bits per pixel
+  putLittleEndian(header + 34, imageBytes, 4);
+  putLittleEndian(header + 38, 2835, 4);       // 72 dpi
+  putLittleEndian(header + 42, 2835, 4);
+  bool ok= fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+  // the file is bottom up already, so flipping means top down
+  int rowsPerWrite= std::max((size_t) 1, WRITE_BUFFER_BYTES / paddedBytes);
+  std::vector<unsigned char> buffer(rowsPerWrite * paddedBytes, 0);
+  for (int i= 0; i < height && ok; i+= rowsPerWrite) {
+    int numRows= std::min(rowsPerWrite, height - i);
+    for (int r= 0; r < numRows; r++) {
+      int y= flip ? i + r : height - 1 - (i + r);
+      const unsigned char* in= data + y * rowBytes;
+      unsigned char* out= &buffer[r * paddedBytes];
+      for (size_t x= 0; x < rowBytes; x+= CHANNELS) {
+        out[x]= in[x + 2];
+        out[x + 1]= in[x + 1];
+        out[x + 2]= in[x];
+      }
+    }
+    ok= fwrite(buffer.data(), 1, numRows * paddedBytes, file) == numRows * paddedBytes;
+  }
+
+  ok= fclose(file) == 0 && ok;
+  return ok;
+}
+
+// A pixel as 0xAABBGGRR, which compares and stores in one go
+inline uint32_t qoiPixel(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  return r | g << 8 | b << 16 | (uint32_t) a << 24;
+}
+
+inline int qoiHash(uint32_t px)
+{
+  return ((px & 0xff) * 3 + (px >> 8 & 0xff) * 5 + (px >> 16 & 0xff) * 7 +
+    (px >> 24) * 11) % 64;
+}
+
+bool agl::writeQOI(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip)
+{
+  if (width <= 0 || height <= 0 || (int64_t) width * height > QOI_MAX_PIXELS) return false;
+  FILE* file= fopen(filename.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  unsigned char header[QOI_HEADER_BYTES]= {'q', 'o', 'i', 'f'};
+  putBigEndian(header + 4, width);
+  putBigEndian(header + 8, height);
+  header[12]= CHANNELS;
+  header[13]= 0; // sRGB
+  bool ok= fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+  // a pixel takes at most 5 bytes (a run it ends and its color), the
+  // buffer is written out whenever that and the end might not fit
+  std::vector<unsigned char> buffer(WRITE_BUFFER_BYTES);
+  unsigned char* out= buffer.data();
+  unsigned char* flushAt= buffer.data() + buffer.size() - 16;
+
+  // the index starts out all zero, alpha included, so no RGB pixel
+  // matches an unused entry
+  uint32_t index[64]= {0};
+  uint32_t previous= qoiPixel(0, 0, 0, 255);
+  int run= 0;
+  const size_t rowBytes= (size_t) width * CHANNELS;
+
+  for (int i= 0; i < height && ok; i++) {
+    const unsigned char* in= data + (flip ? height - 1 - i : i) * rowBytes;
+    for (size_t x= 0; x < rowBytes; x+= CHANNELS) {
+      if (out >= flushAt) {
+        ok= fwrite(buffer.data(), 1, out - buffer.data(), file) == (size_t) (out - buffer.data());
+        out= buffer.data();
+      }
+
+      uint32_t px= qoiPixel(in[x], in[x + 1], in[x + 2], 255);
+      if (px == previous) {
+        if (++run == QOI_MAX_RUN) {
+          *out++= QOI_OP_RUN | (run - 1);
+          run= 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        *out++= QOI_OP_RUN | (run - 1);
+        run= 0;
+      }
+
+      int hash= qoiHash(px);
+      if (index[hash] == px) {
+        *out++= QOI_OP_INDEX | hash;
+      }
+      else {
+        index[hash]= px;
+        // the differences wrap around, as the decoder's sums do
+        signed char dr= in[x] - (previous & 0xff);
+        signed char dg= in[x + 1] - (previous >> 8 & 0xff);
+        signed char db= in[x + 2] - (previous >> 16 & 0xff);
+        signed char drdg= dr - dg;
+        signed char dbdg= db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          *out++= QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        }
+        else if (dg >= -32 && dg <= 31 && drdg >= -8 && drdg <= 7 && dbdg >= -8 && dbdg <= 7) {
+          *out++= QOI_OP_LUMA | (dg + 32);
+          *out++= (drdg + 8) << 4 | (dbdg + 8);
+        }
+        else {
+          *out++= QOI_OP_RGB;
+          *out++= in[x];
+          *out++= in[x + 1];
+          *out++= in[x + 2];
+        }
+      }
+      previous= px;
+    }
+  }
+  if (run > 0) *out++= QOI_OP_RUN | (run - 1);
+  std::memcpy(out, QOI_END, sizeof(QOI_END));
+  out+= sizeof(QOI_END);
+
+  ok= ok && fwrite(buffer.data(), 1, out - buffer.data(), file) == (size_t) (out - buffer.data());
+  ok= fclose(file) == 0 && ok;
+  return ok;
+}
+
+bool agl::readQOI(const std::string& filename, std::vector<unsigned char>& data,
+  int& width, int& height)
+{
+  FILE* file= fopen(filename.c_str(), "rb");
+  if (file == nullptr) return false;
+  fseek(file, 0, SEEK_END);
+  long size= ftell(file);
+  fseek(file, 0, SEEK_SET);
+  std::vector<unsigned char> bytes(std::max(size, 0L));
+  bool ok= size > 0 && fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  fclose(file);
+  if (!ok) return false;
+
+  if (bytes.size() < QOI_HEADER_BYTES + sizeof(QOI_END) ||
+    std::memcmp(bytes.data(), "qoif", 4) != 0) {
+    return false;
+  }
+  uint32_t w= getBigEndian(&bytes[4]);
+  uint32_t h= getBigEndian(&bytes[8]);
+  if (w == 0 || h == 0 || (bytes[12] != 3 && bytes[12] != 4) ||
+    (int64_t) w * h > QOI_MAX_PIXELS) {
+    return false;
+  }
+
+  width= w;
+  height= h;
+  data.resize((size_t) w * h * CHANNELS);
+
+  uint32_t index[64]= {0};
+  uint32_t px= qoiPixel(0, 0, 0, 255);
+  int run= 0;
+  size_t p= QOI_HEADER_BYTES;
+  // the end marker is never read as pixels, a truncated file repeats
+  // the last pixel instead of reading past the end
+  const size_t end= bytes.size() - sizeof(QOI_END);
+
+  for (size_t i= 0; i < data.size(); i+= CHANNELS) {
+    if (run > 0) {
+      run--;
+    }
+    else if (p < end) {
+      unsigned char op= bytes[p++];
+      unsigned char r= px, g= px >> 8, b= px >> 16, a= px >> 24;
+      if (op == QOI_OP_RGB && p + 3 <= end) {
+        r= bytes[p];
+        g= bytes[p + 1];
+        b= bytes[p + 2];
+        p+= 3;
+      }
+      else if (op == QOI_OP_RGBA && p + 4 <= end) {
+        r= bytes[p];
+        g= bytes[p + 1];
+        b= bytes[p + 2];
+        a= bytes[p + 3];
+        p+= 4;
+      }
+      else if ((op & QOI_MASK) == QOI_OP_INDEX) {
+        uint32_t entry= index[op];
+        r= entry;
+        g= entry >> 8;
+        b= entry >> 16;
+        a= entry >> 24;
+      }
+      else if ((op & QOI_MASK) == QOI_OP_DIFF) {
+        r+= (op >> 4 & 3) - 2;
+        g+= (op >> 2 & 3) - 2;
+        b+= (op & 3) - 2;
+      }
+      else if ((op & QOI_MASK) == QOI_OP_LUMA && p < end) {
+        unsigned char next= bytes[p++];
+        int dg= (op & 0x3f) - 32;
+        r+= dg - 8 + (next >> 4 & 0x0f);
+        g+= dg;
+        b+= dg - 8 + (next & 0x0f);
+      }
+      else if ((op & QOI_MASK) == QOI_OP_RUN) {
+        run= op & 0x3f;
+      }
+      px= qoiPixel(r, g, b, a);
+      index[qoiHash(px)]= px;
+    }
+
+    data[i]= px;
+    data[i + 1]= px >> 8;
+    data[i + 2]= px >> 16;
+  }
+  return true;
+}
+
+bool agl::writeJPG(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip, int quality)
+{
+  if (width <= 0 || height <= 0) return false;
+  quality= std::min(std::max(quality, 1), 100);
+
+  // stb only flips through a global setting, so flipping goes through a copy
+  std::vector<unsigned char> flipped;
+  if (flip) {
+    const size_t rowBytes= (size_t) width * CHANNELS;
+    flipped.resize(rowBytes * height);
+    for (int y= 0; y < height; y++) {
+      std::memcpy(&flipped[y * rowBytes], data + (height - 1 - y) * rowBytes, rowBytes);
+    }
+    data= flipped.data();
+  }
+  return stbi_write_jpg(filename.c_str(), width, height, CHANNELS, data, quality) != 0;
+}
+
+struct RawHeader {
+  int width;
+  int height;
+  int channels;
+  size_t stride;
+  size_t offset;
+};
+
+// Checks the header against the size of the whole file
+bool readRawHeader(const unsigned char* in, size_t fileBytes, RawHeader& header)
+{
+  if (fileBytes < RAW_HEADER_BYTES || std::memcmp(in, RAW_MAGIC, sizeof(RAW_MAGIC)) != 0) {
+    return false;
+  }
+  uint32_t width= getLittleEndian(in + 8);
+  uint32_t height= getLittleEndian(in + 12);
+  uint32_t channels= getLittleEndian(in + 16);
+  header.stride= getLittleEndian(in + 20);
+  header.offset= getLittleEndian(in + 24);
+  // Image counts its bytes in an int
+  if (width == 0 || height == 0 || (uint64_t) width * height * CHANNELS > INT32_MAX ||
+    (channels != 3 && channels != 4) || header.stride < (size_t) width * channels ||
+    header.offset < RAW_HEADER_BYTES || header.offset > fileBytes ||
+    (fileBytes - header.offset) / header.stride < height) {
+    return false;
+  }
+  header.width= width;
+  header.height= height;
+  header.channels= channels;
+  return true;
+}
+
+bool agl::writeRaw(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip)
+{
+  if (width <= 0 || height <= 0) return false;
+  std::string temporary= filename + ".tmp";
+  FILE* file= fopen(temporary.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  const size_t rowBytes= (size_t) width * CHANNELS;
+  unsigned char header[RAW_HEADER_BYTES]= {0};
+  std::memcpy(header, RAW_MAGIC, sizeof(RAW_MAGIC));
+  putLittleEndian(header + 8, width, 4);
+  putLittleEndian(header + 12, height, 4);
+  putLittleEndian(header + 16, CHANNELS, 4);
+  putLittleEndian(header + 20, rowBytes, 4);
+  putLittleEndian(header + 24, RAW_HEADER_BYTES, 4);
+  bool ok= fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  if (!flip) {
+    ok= ok && fwrite(data, 1, rowBytes * height, file) == rowBytes * height;
+  }
+  else {
+    for (int y= height - 1; y >= 0 && ok; y--) {
+      ok= fwrite(data + y * rowBytes, 1, rowBytes, file) == rowBytes;
+    }
+  }
+  ok= fclose(file) == 0 && ok;
+
+#if defined(_WIN32)
+  // rename doesn't replace files here
+  if (ok) std::remove(filename.c_str());
+#endif
+  ok= ok && std::rename(temporary.c_str(), filename.c_str()) == 0;
+  if (!ok) std::remove(temporary.c_str());
+  return ok;
+}
+
+bool agl::readRaw(const std::string& filename, std::vector<unsigned char>& data,
+  int& width, int& height)
+{
+  FILE* file= fopen(filename.c_str(), "rb");
+  if (file == nullptr) return false;
+  fseek(file, 0, SEEK_END);
+  long size= ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  RawHeader header;
+  unsigned char in[RAW_HEADER_BYTES];
+  bool ok= size >= (long) RAW_HEADER_BYTES && fread(in, 1, sizeof(in), file) == sizeof(in) &&
+    readRawHeader(in, (size_t) size, header) && fseek(file, header.offset, SEEK_SET) == 0;
+  if (ok) {
+    width= header.width;
+    height= header.height;
+    data.resize((size_t) width * height * CHANNELS);
+    std::vector<unsigned char> row(header.stride);
+    for (int y= 0; y < height && ok; y++) {
+      ok= fread(row.data(), 1, row.size(), file) == row.size();
+      unsigned char* out= &data[(size_t) y * width * CHANNELS];
+      for (int x= 0; x < width; x++) {
+        std::memcpy(out + x * CHANNELS, &row[x * header.channels], CHANNELS);
+      }
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+#if defined(_WIN32)
+unsigned char* agl::mapRaw(const std::string&, int&, int&, void*&, size_t&)
+{
+  return nullptr;
+}
+
+void agl::unmapRaw(void*, size_t)
+{
+}
+#else
+unsigned char* agl::mapRaw(const std::string& filename, int& width, int& height,
+  void*& mapping, size_t& mappedBytes)
+{
+  int fd= open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t) RAW_HEADER_BYTES) {
+    close(fd);
+    return nullptr;
+  }
+
+  // private, so writes to the pixels copy the page instead of reaching the file
+  size_t bytes= info.st_size;
+  void* address= mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) return nullptr;
+
+  RawHeader header;
+  const unsigned char* in= (const unsigned char*) address;
+  if (!readRawHeader(in, bytes, header) || header.channels != CHANNELS || 
+    header.stride != (size_t) header.width * CHANNELS || 
+    header.offset % PIXEL_ALIGNMENT != 0) {
+    munmap(address, bytes);
+    return nullptr;
+  }
+  width= header.width;
+  height= header.height;
+  mapping= address;
+  mappedBytes= bytes;
+  return (unsigned char*) address + header.offset;
+}
+
+void agl::unmapRaw(void* mapping, size_t mappedBytes)
+{
+  munmap(mapping, mappedBytes);
+}
+#endif
+
+bool agl::probeImage(const std::string& filename, int& width, int& height)
+{
+  ImageFormat format= imageFormat(filename);
+  if (format != QOI && format != RAW) {
+    return stbi_info(filename.c_str(), &width, &height, nullptr) != 0;
+  }
+
+  FILE* file= fopen(filename.c_str(), "rb");
+  if (file == nullptr) return false;
+  fseek(file, 0, SEEK_END);
+  long size= ftell(file);
+  fseek(file, 0, SEEK_SET);
+  unsigned char in[RAW_HEADER_BYTES];
+  size_t numRead= fread(in, 1, sizeof(in), file);
+  fclose(file);
+
+  if (format == RAW) {
+    RawHeader header;
+    if (size < 0 || !readRawHeader(in, (size_t) size, header)) return false;
+    width= header.width;
+    height= header.height;
+    return true;
+  }
+  if (numRead < QOI_HEADER_BYTES || std::memcmp(in, "qoif", 4) != 0) return false;
+  uint32_t w= getBigEndian(in + 4);
+  uint32_t h= getBigEndian(in + 8);
+  if (w == 0 || h == 0 || (in[12] != 3 && in[12] != 4) ||
+    (int64_t) w * h > QOI_MAX_PIXELS) {
+    return false;
+  }
+  width= w;
+  height= h;
+  return true;
+}
+
+bool agl::writeImage(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip, int level, int quality)
+{
+  switch (imageFormat(filename)) {
+    case PPM: return writePPM(filename, data, width, height, flip);
+    case BMP: return writeBMP(filename, data, width, height, flip);
+    case QOI: return writeQOI(filename, data, width, height, flip);
+    case JPG: return writeJPG(filename, data, width, height, flip, quality);
+    case RAW: return writeRaw(filename, data, width, height, flip);
+    default: return writePNG(filename, data, width, height, flip, level);
+  }
+}
@@ -0,0 +1,83 @@
+/*-----------------------------------------------
+ * Description: Readers and writers for the file
+ * formats besides PNG, and the choice between
+ * them by file extension.
+ ----------------------------------------------*/
+
+#ifndef image_formats_H_
+#define image_formats_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace agl
+{
+  // PPM is binary P6, BMP is 24 bit uncompressed, QOI is the lossless
+  // "Quite OK Image" format and JPG is lossy. RAW is our own container,
+  // a RAW_HEADER_BYTES header and then the rows as they are in memory,
+  // so it can be mapped instead of read
+  enum ImageFormat { PNG, PPM, BMP, QOI, JPG, RAW };
+
+  // The header is "AGLRAW01", then width, height, channels, the bytes
+  // per row and the offset of the pixels as 32 bit little endian ints,
+  // zero filled up to the pixels
+  const size_t RAW_HEADER_BYTES= 64;
+
+  // The format the extension of filename asks for (.png, .ppm, .pnm,
+  // .bmp, .qoi, .jpg, .jpeg, .raw in any case), PNG for anything else
+  ImageFormat imageFormat(const std::string& filename);
+
+  // The writers take width x height RGB data and write it bottom row
+  // first when flip. They return false if the file can't be written
+
+  bool writePPM(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false);
+
+  bool writeBMP(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false);
+
+  bool writeQOI(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false);
+
+  // Writes to a temporary file that then replaces filename, so
+  // mappings of the old file, even by other processes, keep their pixels
+  bool writeRaw(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false);
+
+  const int JPG_DEFAULT_QUALITY= 90;
+
+  // quality goes from 1 to 100
+  bool writeJPG(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false, int quality = JPG_DEFAULT_QUALITY);
+
+  // Writes in the format of the filename's extension, level is the PNG
+  // compression level and quality the JPG one
+  bool writeImage(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip, int level, int quality);
+
+  // Sets the size of the image in filename from its header alone,
+  // returns false if it isn't an image we can read
+  bool probeImage(const std::string& filename, int& width, int& height);
+
+  // Reads a QOI file into width x height RGB data, dropping any alpha.
+  // Returns false if the file can't be read or isn't a QOI image
+  bool readQOI(const std::string& filename, std::vector<unsigned char>& data,
+    int& width, int& height);
+
+  // Reads a RAW file of 3 or 4 channels and any row padding into width
+  // x height RGB data. Returns false if it can't be read or isn't RAW
+  bool readRaw(const std::string& filename, std::vector<unsigned char>& data,
+    int& width, int& height);
+
+  // Maps a RAW file of packed RGB rows copy-on-write: pages are read
+  // when first touched and copied when first written, the file never
+  // changes. Returns the pixels and sets mapping and mappedBytes for
+  // unmapRaw, or returns nullptr if the file can't be mapped that way
+  // (or on Windows), readRaw still reads it then
+  unsigned char* mapRaw(const std::string& filename, int& width, int& height,
+    void*& mapping, size_t& mappedBytes);
+  void unmapRaw(void* mapping, size_t mappedBytes);
+}
+
+#endif
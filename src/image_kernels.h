@@ -0,0 +1,33 @@
+/*-----------------------------------------------
+ * Description: The row kernels behind Image's
+ * stencil filters, shared with image_expr. Each
+ * reads the width x height RGB image src, repeats
+ * its edge pixels past the borders and writes only
+ * the rows [yBegin, yEnd) of dst.
+ ----------------------------------------------*/
+
+#ifndef image_kernels_H_
+#define image_kernels_H_
+
+#include <vector>
+
+namespace agl
+{
+  // Averages the (2*radius+1)^2 square around every pixel
+  void slidingBoxBlur(const unsigned char* src, unsigned char* dst,
+    int width, int height, int radius, int yBegin, int yEnd);
+
+  // Gaussian weights reaching 3 sigma out, in fixed point for separableBlurRows
+  std::vector<int> gaussianWeights(float sigma);
+
+  // Convolves with the same 1D kernel vertically then horizontally
+  void separableBlurRows(const unsigned char* src, unsigned char* dst,
+    int width, int height, const std::vector<int>& weights, int yBegin, int yEnd);
+
+  // The Sobel magnitude of each channel, plus its direction when
+  // orientation isn't null
+  void sobelRows(const unsigned char* src, unsigned char* magnitude,
+    unsigned char* orientation, int width, int height, int yBegin, int yEnd);
+}
+
+#endif
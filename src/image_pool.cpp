@@ -0,0 +1,107 @@
+#include "image_pool.h"
+#include <cstdlib>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+using namespace agl;
+
+// Free buffers of each size the shared pool keeps, enough for the
+// temporaries of a filter chain like glow()
+const int SHARED_POOL_BUFFERS= 4;
+
+unsigned char* agl::alignedAlloc(size_t bytes)
+{
+  // the rows are RGB so round up, a few spare bytes also let
+  // wide loads run past the last pixel
+  bytes= (bytes + PIXEL_ALIGNMENT - 1) / PIXEL_ALIGNMENT * PIXEL_ALIGNMENT;
+#if defined(_WIN32)
+  return (unsigned char*) _aligned_malloc(bytes, PIXEL_ALIGNMENT);
+#else
+  void* data= nullptr;
+  if (posix_memalign(&data, PIXEL_ALIGNMENT, bytes) != 0) return nullptr;
+  return (unsigned char*) data;
+#endif
+}
+
+void agl::alignedFree(unsigned char* data)
+{
+#if defined(_WIN32)
+  _aligned_free(data);
+#else
+  free(data);
+#endif
+}
+
+ImagePool::ImagePool(int maxBuffers) : myMaxBuffers(maxBuffers)
+{
+}
+
+ImagePool::~ImagePool()
+{
+  this->clear();
+}
+
+unsigned char* ImagePool::acquire(int width, int height)
+{
+  if (width <= 0 || height <= 0) return nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    auto it= this->myBuffers.find(std::make_pair(width, height));
+    if (it != this->myBuffers.end() && !it->second.empty()) {
+      unsigned char* data= it->second.back();
+      it->second.pop_back();
+      return data;
+    }
+  }
+  return alignedAlloc((size_t) width * height * 3);
+}
+
+void ImagePool::release(unsigned char* data, int width, int height)
+{
+  if (data == nullptr) return;
+
+  {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    std::vector<unsigned char*>& buffers= 
+      this->myBuffers[std::make_pair(width, height)];
+    if ((int) buffers.size() < this->myMaxBuffers) {
+      buffers.push_back(data);
+      return;
+    }
+  }
+  alignedFree(data);
+}
+
+void ImagePool::setMaxBuffers(int maxBuffers)
+{
+  std::lock_guard<std::mutex> lock(this->myMutex);
+  this->myMaxBuffers= maxBuffers;
+  for (auto& entry: this->myBuffers) {
+    std::vector<unsigned char*>& buffers= entry.second;
+    while ((int) buffers.size() > maxBuffers) {
+      alignedFree(buffers.back());
+      buffers.pop_back();
+    }
+  }
+}
+
+void ImagePool::clear()
+{
+  std::lock_guard<std::mutex> lock(this->myMutex);
+  for (auto& entry: this->myBuffers) {
+    for (unsigned char* data: entry.second) {
+      alignedFree(data);
+    }
+  }
+  this->myBuffers.clear();
+}
+
+ImagePool& ImagePool::shared()
+{
+  // never destroyed, so images that outlive static destruction
+  // can still hand their buffers back
+  static ImagePool* pool= new ImagePool(SHARED_POOL_BUFFERS);
+  return *pool;
+}
@@ -0,0 +1,62 @@
+/*-----------------------------------------------
+ * Description: Aligned pixel storage for Image
+ * and a pool that recycles frame sized buffers,
+ * so chains of filters stop allocating once the
+ * pool has warmed up.
+ ----------------------------------------------*/
+
+#ifndef image_pool_H_
+#define image_pool_H_
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace agl
+{
+  // Alignment of every pixel buffer, one cache line
+  const size_t PIXEL_ALIGNMENT= 64;
+
+  // Allocate and free PIXEL_ALIGNMENT aligned buffers
+  unsigned char* alignedAlloc(size_t bytes);
+  void alignedFree(unsigned char* data);
+
+  class ImagePool
+  {
+  public:
+    // Keeps at most maxBuffers free buffers of each size
+    ImagePool(int maxBuffers);
+    virtual ~ImagePool();
+
+    ImagePool(const ImagePool&)= delete;
+    ImagePool& operator=(const ImagePool&)= delete;
+
+    // Returns a buffer for a width x height RGB image, reusing a
+    // free one if there is one. Returns nullptr for empty images
+    unsigned char* acquire(int width, int height);
+
+    // Hands the buffer of a width x height image back to the pool,
+    // freeing it if the pool already holds enough of that size
+    void release(unsigned char* data, int width, int height);
+
+    // Changes how many free buffers of each size are kept,
+    // 0 turns pooling off
+    void setMaxBuffers(int maxBuffers);
+
+    // Frees every buffer the pool holds
+    void clear();
+
+    // The pool used by Image
+    static ImagePool& shared();
+
+  private:
+    std::mutex myMutex;
+    int myMaxBuffers;
+    // free buffers keyed by (width, height)
+    std::map<std::pair<int, int>, std::vector<unsigned char*>> myBuffers;
+  };
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*-----------------------------------------------
+ * Description: The per-pixel operations behind
+ * Image's pointwise filters. Each one works on
+ * the three RGB bytes of a pixel and reads all
+ * of its inputs before writing, so the output
+ * may be the same bytes as an input.
+ ----------------------------------------------*/
+
+#ifndef pixel_ops_H_
+#define pixel_ops_H_
+
+#include "image.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace agl
+{
+  // Calls op(in, out) on every pixel of a width x height RGB image,
+  // a band of rows per task on the shared thread pool
+  template <class Op>
+  void pointwise(const unsigned char* in, unsigned char* out, 
+    int width, int height, const Op& op)
+  {
+    ThreadPool::shared().parallelRows(height, [&](int begin, int end) {
+      for (int i= begin * width * 3; i < end * width * 3; i+= 3) {
+        op(in + i, out + i);
+      }
+    });
+  }
+
+  // Calls op(a, b, out) on every pixel of two width x height RGB images
+  template <class Op>
+  void pointwise(const unsigned char* a, const unsigned char* b, 
+    unsigned char* out, int width, int height, const Op& op)
+  {
+    ThreadPool::shared().parallelRows(height, [&](int begin, int end) {
+      for (int i= begin * width * 3; i < end * width * 3; i+= 3) {
+        op(a + i, b + i, out + i);
+      }
+    });
+  }
+
+  struct InvertOp {
+    void operator()(const unsigned char* in, unsigned char* out) const
+    {
+      out[0]= 255 - in[0];
+      out[1]= 255 - in[1];
+      out[2]= 255 - in[2];
+    }
+  };
+
+  struct GrayscaleOp {
+    void operator()(const unsigned char* in, unsigned char* out) const
+    {
+      // Hardcoded values to make the greyscale intensity to look pleasing to human eye
+      unsigned char intensity= (float) in[0] * 0.3f + (float) in[1] * 0.59f + 
+        (float) in[2] * 0.11f;
+      out[0]= intensity;
+      out[1]= intensity;
+      out[2]= intensity;
+    }
+  };
+
+  // red takes green's value, green takes blue's and blue takes red's
+  struct SwirlOp {
+    void operator()(const unsigned char* in, unsigned char* out) const
+    {
+      unsigned char red= in[0];
+      out[0]= in[1];
+      out[1]= in[2];
+      out[2]= red;
+    }
+  };
+
+  // Keeps the pixels with every channel between low and high, blacks out the rest
+  struct ExtractOp {
+    Pixel low;
+    Pixel high;
+
+    void operator()(const unsigned char* in, unsigned char* out) const
+    {
+      bool outside= in[0] < this->low.r || in[1] < this->low.g || in[2] < this->low.b ||
+        in[0] > this->high.r || in[1] > this->high.g || in[2] > this->high.b;
+      out[0]= outside ? 0 : in[0];
+      out[1]= outside ? 0 : in[1];
+      out[2]= outside ? 0 : in[2];
+    }
+  };
+
+  // Keeps the given channel (0 red, 1 green, 2 blue) and zeroes the others
+  struct ChannelOp {
+    int channel;
+
+    void operator()(const unsigned char* in, unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) {
+        out[c]= (c == this->channel) ? in[c] : 0;
+      }
+    }
+  };
+
+  struct AddOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::min(a[c] + b[c], 255);
+    }
+  };
+
+  struct SubtractOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::max(a[c] - b[c], 0);
+    }
+  };
+
+  struct MultiplyOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::min(a[c] * b[c], 255);
+    }
+  };
+
+  struct DifferenceOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::abs(a[c] - b[c]);
+    }
+  };
+
+  struct LightestOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::max(a[c], b[c]);
+    }
+  };
+
+  struct DarkestOp {
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) out[c]= std::min(a[c], b[c]);
+    }
+  };
+
+  // out = a * (1-alpha) + b * alpha
+  struct AlphaBlendOp {
+    float alpha;
+
+    void operator()(const unsigned char* a, const unsigned char* b, 
+      unsigned char* out) const
+    {
+      for (int c= 0; c < 3; c++) {
+        out[c]= (float) a[c] * (1 - this->alpha) + (float) b[c] * this->alpha;
+      }
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,438 @@
+#include "png_writer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace agl;
+
+/**
+ * The image is cut into bands of rows. Each band is filtered (the
+ * filter of every row picked by the smallest sum of absolute values,
+ * as most encoders do) and deflated on its own into a fixed Huffman
+ * block, closed by a sync flush: an empty stored block that ends the
+ * band on a byte boundary. Those bands then join into one zlib stream,
+ * each written as its own IDAT chunk, with the checksums of the bands
+ * combined at the end. A band only reads the image rows it covers and
+ * the row above, so a group of bands is compressed in parallel, written
+ * out and dropped before the next group starts.
+*/
+
+const int CHANNELS= 3;
+
+// Bands aim for this many bytes of rows, at least BAND_MIN_ROWS rows
+const int BAND_BYTES= 1 << 18;
+const int BAND_MIN_ROWS= 16;
+
+const int MIN_MATCH= 3;
+const int MAX_MATCH= 258;
+const int WINDOW_SIZE= 32768;
+const int HASH_BITS= 15;
+
+// Hash chain steps tried per position at each level, 0 stores
+const int CHAIN_LENGTHS[]= {0, 1, 4, 8, 16, 32, 64, 128, 512, 2048};
+
+const int LENGTH_BASE[]= {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+  31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LENGTH_EXTRA[]= {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3,
+  3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DISTANCE_BASE[]= {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97,
+  129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+  12289, 16385, 24577};
+const int DISTANCE_EXTRA[]= {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Packs bits into bytes, least significant bit first as deflate wants
+class BitWriter
+{
+public:
+  BitWriter(std::vector<unsigned char>& out) : myOut(out) {}
+
+  // Adds the low count bits of value, count <= 16
+  void put(uint32_t value, int count)
+  {
+    this->myBits|= value << this->myCount;
+    this->myCount+= count;
+    while (this->myCount >= 8) {
+      this->myOut.push_back(this->myBits & 0xFF);
+      this->myBits>>= 8;
+      this->myCount-= 8;
+    }
+  }
+
+  // Pads with zeros up to the next byte
+  void align()
+  {
+    if (this->myCount > 0) this->put(0, 8 - this->myCount);
+  }
+
+private:
+  std::vector<unsigned char>& myOut;
+  uint32_t myBits= 0;
+  int myCount= 0;
+};
+
+// Huffman codes go most significant bit first, so they're kept reversed
+uint32_t reverseBits(uint32_t code, int count)
+{
+  uint32_t reversed= 0;
+  for (int i= 0; i < count; i++) {
+    reversed= (reversed << 1) | ((code >> i) & 1);
+  }
+  return reversed;
+}
+
+// The fixed Huffman codes, and which length or distance code covers each value
+struct FixedCodes {
+  uint16_t symbolCode[288];
+  uint8_t symbolBits[288];
+  uint16_t distanceCode[30];
+  uint8_t lengthIndex[MAX_MATCH + 1];
+  uint8_t distanceIndex[512]; // distances up to 256, then (d - 1) >> 7 past that
+
+  FixedCodes()
+  {
+    for (int s= 0; s < 288; s++) {
+      int code, bits;
+      if (s < 144) { code= 0x30 + s; bits= 8; }
+      else if (s < 256) { code= 0x190 + s - 144; bits= 9; }
+      else if (s < 280) { code= s - 256; bits= 7; }
+      else { code= 0xC0 + s - 280; bits= 8; }
+      this->symbolCode[s]= reverseBits(code, bits);
+      this->symbolBits[s]= bits;
+    }
+    for (int d= 0; d < 30; d++) this->distanceCode[d]= reverseBits(d, 5);
+    for (int l= MIN_MATCH; l <= MAX_MATCH; l++) {
+      this->lengthIndex[l]= std::upper_bound(LENGTH_BASE, LENGTH_BASE + 29, l) - 
+        LENGTH_BASE - 1;
+    }
+    for (int i= 0; i < 512; i++) {
+      int d= i < 256 ? i + 1 : ((i - 256) << 7) + 1;
+      this->distanceIndex[i]= std::upper_bound(DISTANCE_BASE, DISTANCE_BASE + 30, d) - 
+        DISTANCE_BASE - 1;
+    }
+  }
+};
+
+const FixedCodes& fixedCodes()
+{
+  static const FixedCodes codes;
+  return codes;
+}
+
+// A literal byte, or with 256 and up, end of block and match lengths
+inline void putSymbol(BitWriter& bits, const FixedCodes& codes, int symbol)
+{
+  bits.put(codes.symbolCode[symbol], codes.symbolBits[symbol]);
+}
+
+inline void putMatch(BitWriter& bits, const FixedCodes& codes, int length, int distance)
+{
+  int l= codes.lengthIndex[length];
+  putSymbol(bits, codes, 257 + l);
+  bits.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+  // codes past 256 all start on a multiple of 128, plus one
+  int d= codes.distanceIndex[distance <= 256 ? distance - 1 : 256 + ((distance - 1) >> 7)];
+  bits.put(codes.distanceCode[d], 5);
+  bits.put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+inline uint32_t hash3(const unsigned char* p)
+{
+  uint32_t v= p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * Deflates data as one fixed Huffman block followed by a sync flush,
+ * finding matches greedily along hash chains of at most maxChain steps.
+*/
+void deflateBand(const unsigned char* data, int size, int maxChain,
+  std::vector<unsigned char>& out)
+{
+  const FixedCodes& codes= fixedCodes();
+  BitWriter bits(out);
+  bits.put(0, 1); // not the last block
+  bits.put(1, 2); // fixed Huffman codes
+
+  std::vector<int> head(1 << HASH_BITS, -1);
+  std::vector<int> previous(size);
+  auto insert= [&](int i) {
+    uint32_t h= hash3(data + i);
+    previous[i]= head[h];
+    head[h]= i;
+  };
+
+  int i= 0;
+  while (i < size) {
+    int bestLength= 0;
+    int bestDistance= 0;
+    if (i + MIN_MATCH <= size) {
+      int limit= std::min(MAX_MATCH, size - i);
+      int candidate= head[hash3(data + i)];
+      for (int steps= 0; candidate >= 0 && i - candidate <= WINDOW_SIZE &&
+        steps < maxChain; steps++) {
+        // a longer match has to get past the best one's last byte
+        if (data[candidate + bestLength] == data[i + bestLength]) {
+          int length= 0;
+          while (length < limit && data[candidate + length] == data[i + length]) length++;
+          if (length > bestLength) {
+            bestLength= length;
+            bestDistance= i - candidate;
+            if (length == limit) break;
+          }
+        }
+        candidate= previous[candidate];
+      }
+      insert(i);
+    }
+
+    if (bestLength >= MIN_MATCH) {
+      putMatch(bits, codes, bestLength, bestDistance);
+      for (int k= 1; k < bestLength && i + k + MIN_MATCH <= size; k++) insert(i + k);
+      i+= bestLength;
+    } else {
+      putSymbol(bits, codes, data[i]);
+      i++;
+    }
+  }
+  putSymbol(bits, codes, 256); // end of block
+
+  // the sync flush, an empty stored block
+  bits.put(0, 3);
+  bits.align();
+  out.insert(out.end(), {0x00, 0x00, 0xFF, 0xFF});
+}
+
+// Level 0, stored blocks of at most 65535 bytes, each ending byte aligned
+void storeBand(const unsigned char* data, int size, std::vector<unsigned char>& out)
+{
+  for (int start= 0; start < size; start+= 65535) {
+    int length= std::min(size - start, 65535);
+    out.insert(out.end(), {0x00, (unsigned char) (length & 0xFF),
+      (unsigned char) (length >> 8), (unsigned char) (~length & 0xFF),
+      (unsigned char) ((~length >> 8) & 0xFF)});
+    out.insert(out.end(), data + start, data + start + length);
+  }
+}
+
+const uint32_t ADLER_BASE= 65521;
+
+uint32_t adler32(const unsigned char* data, size_t size)
+{
+  uint32_t a= 1;
+  uint32_t b= 0;
+  while (size > 0) {
+    // 5552 bytes is the most that can't overflow b before the modulo
+    size_t n= std::min(size, (size_t) 5552);
+    for (size_t i= 0; i < n; i++) {
+      a+= data[i];
+      b+= a;
+    }
+    a%= ADLER_BASE;
+    b%= ADLER_BASE;
+    data+= n;
+    size-= n;
+  }
+  return (b << 16) | a;
+}
+
+// The Adler-32 of two pieces of data joined, from their own checksums
+uint32_t adler32Combine(uint32_t first, uint32_t second, size_t secondSize)
+{
+  uint32_t remainder= secondSize % ADLER_BASE;
+  uint32_t a= ((first & 0xFFFF) + (second & 0xFFFF) + ADLER_BASE - 1) % ADLER_BASE;
+  uint32_t b= (uint32_t) (((uint64_t) remainder * (first & 0xFFFF)) % ADLER_BASE);
+  b= (b + (first >> 16) + (second >> 16) + ADLER_BASE - remainder) % ADLER_BASE;
+  return (b << 16) | a;
+}
+
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc= 0)
+{
+  static const std::vector<uint32_t> table= [] {
+    std::vector<uint32_t> t(256);
+    for (uint32_t n= 0; n < 256; n++) {
+      uint32_t c= n;
+      for (int k= 0; k < 8; k++) c= (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[n]= c;
+    }
+    return t;
+  }();
+  crc= ~crc;
+  for (size_t i= 0; i < size; i++) crc= table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+void putBigEndian(std::vector<unsigned char>& out, uint32_t value)
+{
+  out.insert(out.end(), {(unsigned char) (value >> 24), (unsigned char) (value >> 16),
+    (unsigned char) (value >> 8), (unsigned char) value});
+}
+
+// Wraps the data in chunk (which starts with 8 free bytes for the
+// length and type) into a PNG chunk with its CRC
+void finishChunk(std::vector<unsigned char>& chunk, const char* type)
+{
+  uint32_t length= chunk.size() - 8;
+  for (int i= 0; i < 4; i++) {
+    chunk[i]= length >> (24 - 8 * i);
+    chunk[4 + i]= type[i];
+  }
+  putBigEndian(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+}
+
+inline int paeth(int a, int b, int c)
+{
+  int p= a + b - c;
+  int pa= std::abs(p - a);
+  int pb= std::abs(p - b);
+  int pc= std::abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+// Filters one row with the given type into out. above is null for the
+// first row. Returns the sum of the magnitudes of the filtered bytes
+long filterRowAs(int type, const unsigned char* row, const unsigned char* above,
+  int rowBytes, unsigned char* out)
+{
+  long cost= 0;
+  auto emit= [&](int i, int predicted) {
+    out[i]= row[i] - predicted;
+    cost+= std::abs((signed char) out[i]);
+  };
+
+  // the first pixel has nothing to its left, and the first row nothing above
+  if (type == 0 || (type == 2 && above == nullptr)) {
+    for (int i= 0; i < rowBytes; i++) emit(i, 0);
+  } else if (type == 1 || (type == 4 && above == nullptr)) {
+    for (int i= 0; i < CHANNELS; i++) emit(i, 0);
+    for (int i= CHANNELS; i < rowBytes; i++) emit(i, row[i - CHANNELS]);
+  } else if (type == 2) {
+    for (int i= 0; i < rowBytes; i++) emit(i, above[i]);
+  } else if (type == 3) {
+    for (int i= 0; i < CHANNELS; i++) emit(i, above ? above[i] >> 1 : 0);
+    for (int i= CHANNELS; i < rowBytes; i++) {
+      emit(i, (row[i - CHANNELS] + (above ? above[i] : 0)) >> 1);
+    }
+  } else {
+    for (int i= 0; i < CHANNELS; i++) emit(i, above[i]);
+    for (int i= CHANNELS; i < rowBytes; i++) {
+      emit(i, paeth(row[i - CHANNELS], above[i], above[i - CHANNELS]));
+    }
+  }
+  return cost;
+}
+
+// Writes the filter type byte and the filtered row to out, with the
+// filter that makes the smallest sum of magnitudes. scratch holds a row
+void filterRow(const unsigned char* row, const unsigned char* above, int rowBytes,
+  unsigned char* scratch, unsigned char* out)
+{
+  long bestCost= filterRowAs(0, row, above, rowBytes, out + 1);
+  out[0]= 0;
+  for (int type= 1; type < 5; type++) {
+    long cost= filterRowAs(type, row, above, rowBytes, scratch);
+    if (cost < bestCost) {
+      bestCost= cost;
+      out[0]= type;
+      std::copy(scratch, scratch + rowBytes, out + 1);
+    }
+  }
+}
+
+bool agl::writePNG(const std::string& filename, const unsigned char* data,
+  int width, int height, bool flip, int level)
+{
+  if (width <= 0 || height <= 0) return false;
+  level= std::min(std::max(level, PNG_FASTEST), PNG_SMALLEST);
+
+  FILE* file= fopen(filename.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  const int rowBytes= width * CHANNELS;
+  auto imageRow= [&](int y) {
+    return data + (size_t) (flip ? height - 1 - y : y) * rowBytes;
+  };
+
+  std::vector<unsigned char> header= {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  std::vector<unsigned char> chunk(8);
+  putBigEndian(chunk, width);
+  putBigEndian(chunk, height);
+  // 8 bit RGB, deflate, adaptive filtering, no interlacing
+  chunk.insert(chunk.end(), {8, 2, 0, 0, 0});
+  finishChunk(chunk, "IHDR");
+  header.insert(header.end(), chunk.begin(), chunk.end());
+  bool ok= fwrite(header.data(), 1, header.size(), file) == header.size();
+
+  ThreadPool& pool= ThreadPool::shared();
+  int bandRows= std::max(BAND_MIN_ROWS, BAND_BYTES / rowBytes);
+  int numBands= (height + bandRows - 1) / bandRows;
+  int groupSize= 2 * pool.threadCount();
+  std::vector<std::vector<unsigned char>> chunks(groupSize);
+  std::vector<uint32_t> adlers(groupSize);
+  std::vector<size_t> sizes(groupSize);
+  uint32_t adler= 1;
+
+  for (int group= 0; group < numBands && ok; group+= groupSize) {
+    int count= std::min(groupSize, numBands - group);
+    pool.parallelFor(count, [&](int i) {
+      int band= group + i;
+      int y0= band * bandRows;
+      int y1= std::min(y0 + bandRows, height);
+
+      std::vector<unsigned char> filtered((size_t) (y1 - y0) * (rowBytes + 1));
+      std::vector<unsigned char> scratch(rowBytes);
+      for (int y= y0; y < y1; y++) {
+        unsigned char* out= &filtered[(size_t) (y - y0) * (rowBytes + 1)];
+        if (level == PNG_FASTEST) {
+          // stored rows don't get any smaller for filtering
+          out[0]= 0;
+          std::copy(imageRow(y), imageRow(y) + rowBytes, out + 1);
+        } else {
+          filterRow(imageRow(y), y > 0 ? imageRow(y - 1) : nullptr, rowBytes, 
+            scratch.data(), out);
+        }
+      }
+      adlers[i]= adler32(filtered.data(), filtered.size());
+      sizes[i]= filtered.size();
+
+      std::vector<unsigned char>& out= chunks[i];
+      out.assign(8, 0);
+      out.reserve(filtered.size() + filtered.size() / 8 + 64);
+      if (band == 0) {
+        // the zlib header, deflate with a 32K window
+        static const unsigned char levelFlags[]= {0x01, 0x01, 0x5E, 0x5E, 0x5E,
+          0x5E, 0x9C, 0xDA, 0xDA, 0xDA};
+        out.insert(out.end(), {0x78, levelFlags[level]});
+      }
+      if (level == PNG_FASTEST) {
+        storeBand(filtered.data(), filtered.size(), out);
+      } else {
+        deflateBand(filtered.data(), filtered.size(), CHAIN_LENGTHS[level], out);
+      }
+      finishChunk(out, "IDAT");
+    });
+
+    for (int i= 0; i < count && ok; i++) {
+      ok= fwrite(chunks[i].data(), 1, chunks[i].size(), file) == chunks[i].size();
+      adler= adler32Combine(adler, adlers[i], sizes[i]);
+    }
+  }
+
+  // an empty final fixed Huffman block, the checksum, then the end
+  std::vector<unsigned char> trailer(8);
+  trailer.insert(trailer.end(), {0x03, 0x00});
+  putBigEndian(trailer, adler);
+  finishChunk(trailer, "IDAT");
+  chunk.assign(8, 0);
+  finishChunk(chunk, "IEND");
+  trailer.insert(trailer.end(), chunk.begin(), chunk.end());
+  ok= ok && fwrite(trailer.data(), 1, trailer.size(), file) == trailer.size();
+
+  ok= fclose(file) == 0 && ok;
+  return ok;
+}
@@ -0,0 +1,26 @@
+/*-----------------------------------------------
+ * Description: A PNG encoder for RGB images that
+ * filters and deflates bands of rows in parallel
+ * and streams them to the file as they finish.
+ ----------------------------------------------*/
+
+#ifndef png_writer_H_
+#define png_writer_H_
+
+#include <string>
+
+namespace agl
+{
+  // Deflate effort, from 0 (rows stored uncompressed) to 9 (smallest)
+  const int PNG_FASTEST= 0;
+  const int PNG_DEFAULT_LEVEL= 6;
+  const int PNG_SMALLEST= 9;
+
+  // Writes the width x height RGB image data to filename as a PNG,
+  // the bottom row first when flip. Returns false if the file can't
+  // be written
+  bool writePNG(const std::string& filename, const unsigned char* data,
+    int width, int height, bool flip = false, int level = PNG_DEFAULT_LEVEL);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "resample.h"
+#include "convolve.h"
+#include "image_pool.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AGL_RESAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace agl;
+
+/**
+ * Each filter is sampled once per axis into a table that holds, for
+ * every output column (or row), the first source pixel it reads, how
+ * many it reads and their weights in RESAMPLE_WEIGHT_BITS fixed point,
+ * adding up to one. Pixel centers line up: output o sits at
+ * (o + 0.5) * in / out in the source. When shrinking, the filter is
+ * stretched by the same ratio so that every source pixel counts. The
+ * area filter instead weighs each source pixel by how much of it the
+ * output pixel covers, so a pixel cut by an edge counts in part for the
+ * outputs on both sides.
+ * The source rows first go through the horizontal table into bytes,
+ * then every output row is a weighted sum of some of those rows, which
+ * is convolve's SIMD row sum. The horizontal pass does two taps of a
+ * pixel at a time with SSE2 madd, the same integer arithmetic as the
+ * scalar loop, so both give the same bytes.
+*/
+
+const int CHANNELS= 3;
+const int RESAMPLE_WEIGHT_BITS= 14;
+const int RESAMPLE_WEIGHT_ONE= 1 << RESAMPLE_WEIGHT_BITS;
+
+struct ResampleTable {
+  int maxTaps;                  // the most taps any output reads
+  std::vector<int> first;       // first source pixel of each output
+  std::vector<int> count;       // taps of each output
+  std::vector<int16_t> weights; // maxTaps per output
+  std::vector<int32_t> pairs;   // the weights two to an int, maxTaps/2 rounded up per output
+};
+
+double sinc(double x)
+{
+  if (x == 0) return 1;
+  x*= M_PI;
+  return std::sin(x) / x;
+}
+
+// How far the filter reaches on either side of the center, in source
+// pixels, for outputs scale source pixels wide
+double filterSupport(ResampleFilter filter, double scale)
+{
+  double stretch= std::max(scale, 1.0);
+  switch (filter) {
+    case BILINEAR: return stretch;
+    case LANCZOS3: return 3 * stretch;
+    // the far edge of the last source pixel it overlaps
+    default: return (scale + 1) / 2;
+  }
+}
+
+// The weight of source pixel x for the output centered at center
+double filterWeight(ResampleFilter filter, int x, double center, double scale)
+{
+  double t= (x + 0.5 - center) / std::max(scale, 1.0);
+  switch (filter) {
+    case BILINEAR: return std::max(1 - std::abs(t), 0.0);
+    case LANCZOS3: return std::abs(t) < 3 ? sinc(t) * sinc(t / 3) : 0;
+    default: {
+      // the overlap of [x, x + 1] with the output's footprint
+      double low= std::max((double) x, center - scale / 2);
+      double high= std::min(x + 1.0, center + scale / 2);
+      return std::max(high - low, 0.0);
+    }
+  }
+}
+
+ResampleTable resampleTable(int inSize, int outSize, ResampleFilter filter)
+{
+  double scale= (double) inSize / outSize;
+  double support= filterSupport(filter, scale);
+
+  ResampleTable table;
+  table.maxTaps= (int) std::ceil(2 * support) + 1;
+  table.first.resize(outSize);
+  table.count.resize(outSize);
+  table.weights.assign((size_t) outSize * table.maxTaps, 0);
+  std::vector<double> exact(table.maxTaps);
+
+  for (int o= 0; o < outSize; o++) {
+    double center= (o + 0.5) * scale;
+    // every x with center - support <= x + 0.5 <= center + support,
+    // the filter edges included, trimmed below if they weigh nothing
+    int begin= std::max((int) std::ceil(center - support - 0.5), 0);
+    int end= std::min(std::min((int) std::floor(center + support - 0.5) + 1, inSize),
+      begin + table.maxTaps);
+
+    double total= 0;
+    for (int x= begin; x < end; x++) {
+      exact[x - begin]= filterWeight(filter, x, center, scale);
+      total+= exact[x - begin];
+    }
+    // the ends may fall just outside the filter
+    while (end - begin > 1 && exact[end - 1 - begin] == 0) end--;
+    while (end - begin > 1 && exact[0] == 0) {
+      std::copy(exact.begin() + 1, exact.begin() + (end - begin), exact.begin());
+      begin++;
+    }
+    if (total == 0) {
+      // nothing under the filter, fall back on the nearest pixel
+      begin= std::min((int) center, inSize - 1);
+      end= begin + 1;
+      exact[0]= total= 1;
+    }
+
+    // rounding may leave the weights off by a little, the largest absorbs it
+    int16_t* weights= &table.weights[(size_t) o * table.maxTaps];
+    int sum= 0;
+    int largest= 0;
+    for (int k= 0; k < end - begin; k++) {
+      weights[k]= (int16_t) std::lround(exact[k] / total * RESAMPLE_WEIGHT_ONE);
+      sum+= weights[k];
+      if (weights[k] > weights[largest]) largest= k;
+    }
+    weights[largest]+= RESAMPLE_WEIGHT_ONE - sum;
+
+    table.first[o]= begin;
+    table.count[o]= end - begin;
+  }
+
+  int numPairs= (table.maxTaps + 1) / 2;
+  table.pairs.resize((size_t) outSize * numPairs);
+  for (int o= 0; o < outSize; o++) {
+    const int16_t* weights= &table.weights[(size_t) o * table.maxTaps];
+    for (int p= 0; p < numPairs; p++) {
+      int16_t second= 2*p + 1 < table.maxTaps ? weights[2*p + 1] : 0;
+      table.pairs[(size_t) o * numPairs + p]= 
+        (uint16_t) weights[2*p] | ((uint32_t) (uint16_t) second << 16);
+    }
+  }
+  return table;
+}
+
+// Resamples the source row in through the table into the outputs [begin, end)
+void resampleRowScalar(const unsigned char* in, unsigned char* out,
+  const ResampleTable& table, int begin, int end)
+{
+  const int32_t half= RESAMPLE_WEIGHT_ONE / 2;
+  for (int o= begin; o < end; o++) {
+    const unsigned char* px= in + table.first[o] * CHANNELS;
+    const int16_t* weights= &table.weights[(size_t) o * table.maxTaps];
+    int32_t sum[CHANNELS]= {half, half, half};
+    for (int k= 0; k < table.count[o]; k++, px+= CHANNELS) {
+      sum[0]+= weights[k] * px[0];
+      sum[1]+= weights[k] * px[1];
+      sum[2]+= weights[k] * px[2];
+    }
+    for (int c= 0; c < CHANNELS; c++) {
+      out[o * CHANNELS + c]= std::min(std::max(sum[c] >> RESAMPLE_WEIGHT_BITS, 0), 255);
+    }
+  }
+}
+
+#if defined(AGL_RESAMPLE_SSE2)
+// Each tap loads 4 bytes for its 3, so outputs whose taps (rounded up
+// to a pair) reach the last source pixel go through the scalar loop
+void resampleRowSSE2(const unsigned char* in, unsigned char* out,
+  const ResampleTable& table, int inSize, int outSize)
+{
+  const __m128i zero= _mm_setzero_si128();
+  const __m128i half= _mm_set1_epi32(RESAMPLE_WEIGHT_ONE / 2);
+  const int numPairs= (table.maxTaps + 1) / 2;
+
+  for (int o= 0; o < outSize; o++) {
+    int numTaps= table.count[o] + table.count[o] % 2;
+    if (table.first[o] + numTaps >= inSize) {
+      resampleRowScalar(in, out, table, o, o + 1);
+      continue;
+    }
+
+    const unsigned char* px= in + table.first[o] * CHANNELS;
+    const int32_t* pairs= &table.pairs[(size_t) o * numPairs];
+    __m128i sum= half;
+    for (int k= 0; k < numTaps; k+= 2, px+= 2 * CHANNELS) {
+      int32_t a, b;
+      std::memcpy(&a, px, 4);
+      std::memcpy(&b, px + CHANNELS, 4);
+      // r0 r1 g0 g1 b0 b1 - -, summed in pairs into r g b -
+      __m128i taps= _mm_unpacklo_epi8(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b)), zero);
+      sum= _mm_add_epi32(sum, _mm_madd_epi16(taps, _mm_set1_epi32(pairs[k/2])));
+    }
+    sum= _mm_srai_epi32(sum, RESAMPLE_WEIGHT_BITS);
+    sum= _mm_packs_epi32(sum, sum);
+    uint32_t rgb= _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    out[o * CHANNELS]= rgb;
+    out[o * CHANNELS + 1]= rgb >> 8;
+    out[o * CHANNELS + 2]= rgb >> 16;
+  }
+}
+#endif
+
+void resampleRow(const unsigned char* in, unsigned char* out,
+  const ResampleTable& table, int inSize, int outSize)
+{
+#if defined(AGL_RESAMPLE_SSE2)
+  resampleRowSSE2(in, out, table, inSize, outSize);
+#else
+  resampleRowScalar(in, out, table, 0, outSize);
+#endif
+}
+
+// The source index of each output for nearest neighbor. The first and
+// last pixels line up, the mapping resize has always used
+std::vector<int> nearestIndices(int inSize, int outSize)
+{
+  std::vector<int> indices(outSize);
+  for (int o= 0; o < outSize; o++) {
+    float ratio= outSize > 1 ? (float) o / (float) (outSize - 1) : 0;
+    indices[o]= ratio * (inSize - 1);
+  }
+  return indices;
+}
+
+void resampleNearest(const unsigned char* src, int srcWidth, int srcHeight,
+  unsigned char* dst, int dstWidth, int dstHeight)
+{
+  std::vector<int> columns= nearestIndices(srcWidth, dstWidth);
+  std::vector<int> rows= nearestIndices(srcHeight, dstHeight);
+  ThreadPool::shared().parallelRows(dstHeight, [&](int begin, int end) {
+    for (int y= begin; y < end; y++) {
+      const unsigned char* in= src + (size_t) rows[y] * srcWidth * CHANNELS;
+      unsigned char* out= dst + (size_t) y * dstWidth * CHANNELS;
+      for (int x= 0; x < dstWidth; x++, out+= CHANNELS) {
+        const unsigned char* px= in + columns[x] * CHANNELS;
+        out[0]= px[0];
+        out[1]= px[1];
+        out[2]= px[2];
+      }
+    }
+  });
+}
+
+void agl::resample(const unsigned char* src, int srcWidth, int srcHeight,
+  unsigned char* dst, int dstWidth, int dstHeight, ResampleFilter filter)
+{
+  if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0) return;
+
+  if (filter == NEAREST) {
+    resampleNearest(src, srcWidth, srcHeight, dst, dstWidth, dstHeight);
+    return;
+  }
+
+  ThreadPool& pool= ThreadPool::shared();
+  const size_t srcRowBytes= (size_t) srcWidth * CHANNELS;
+  const int dstRowBytes= dstWidth * CHANNELS;
+  ResampleTable horizontal= resampleTable(srcWidth, dstWidth, filter);
+  ResampleTable vertical= resampleTable(srcHeight, dstHeight, filter);
+
+  // only the source rows some output row reads go through the first pass
+  std::vector<bool> read(srcHeight, false);
+  for (int y= 0; y < dstHeight; y++) {
+    for (int k= 0; k < vertical.count[y]; k++) read[vertical.first[y] + k]= true;
+  }
+  std::vector<int> readRows;
+  for (int y= 0; y < srcHeight; y++) {
+    if (read[y]) readRows.push_back(y);
+  }
+
+  // the first pass gives a dstWidth x srcHeight image
+  unsigned char* middle= ImagePool::shared().acquire(dstWidth, srcHeight);
+  pool.parallelRows(readRows.size(), [&](int begin, int end) {
+    for (int i= begin; i < end; i++) {
+      int y= readRows[i];
+      resampleRow(src + y * srcRowBytes, middle + (size_t) y * dstRowBytes,
+        horizontal, srcWidth, dstWidth);
+    }
+  });
+
+  // the row sum truncates, a row of ones weighted one half makes it round
+  std::vector<unsigned char> ones(dstRowBytes, 1);
+  pool.parallelRows(dstHeight, [&](int begin, int end) {
+    std::vector<const unsigned char*> rows(vertical.maxTaps + 1);
+    std::vector<int16_t> weights(vertical.maxTaps + 1);
+    for (int y= begin; y < end; y++) {
+      int numTaps= vertical.count[y];
+      for (int k= 0; k < numTaps; k++) {
+        rows[k]= middle + (size_t) (vertical.first[y] + k) * dstRowBytes;
+        weights[k]= vertical.weights[(size_t) y * vertical.maxTaps + k];
+      }
+      rows[numTaps]= ones.data();
+      weights[numTaps]= RESAMPLE_WEIGHT_ONE / 2;
+      weightedRowSum(rows.data(), weights.data(), numTaps + 1, RESAMPLE_WEIGHT_BITS,
+        dst + (size_t) y * dstRowBytes, dstRowBytes);
+    }
+  });
+  ImagePool::shared().release(middle, dstWidth, srcHeight);
+}
@@ -0,0 +1,21 @@
+/*-----------------------------------------------
+ * Description: Resampling of RGB images to a new
+ * size with nearest, bilinear, area and Lanczos-3
+ * filters, as fixed point separable passes.
+ ----------------------------------------------*/
+
+#ifndef resample_H_
+#define resample_H_
+
+#include "image.h"
+
+namespace agl
+{
+  // Resamples the srcWidth x srcHeight RGB image src into the
+  // dstWidth x dstHeight image dst, a band of rows per task on the
+  // shared thread pool. src and dst must not overlap
+  void resample(const unsigned char* src, int srcWidth, int srcHeight,
+    unsigned char* dst, int dstWidth, int dstHeight, ResampleFilter filter);
+}
+
+#endif
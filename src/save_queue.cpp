@@ -0,0 +1,77 @@
+#include "save_queue.h"
+#include "thread_pool.h"
+#include <algorithm>
+
+using namespace agl;
+
+// Frames that may wait to be saved, each one holds a canvas sized buffer
+const int SHARED_QUEUE_CAPACITY= 2;
+
+SaveQueue::SaveQueue(int capacity) : myCapacity(std::max(capacity, 1))
+{
+  this->myWorker= std::thread(&SaveQueue::_workerLoop, this);
+}
+
+SaveQueue::~SaveQueue()
+{
+  // the jobs still queued run first
+  {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    this->myStopping= true;
+  }
+  this->myChanged.notify_all();
+  this->myWorker.join();
+}
+
+std::shared_future<bool> SaveQueue::push(const std::function<bool()>& job)
+{
+  std::packaged_task<bool()> task(job);
+  std::shared_future<bool> result= task.get_future().share();
+  {
+    std::unique_lock<std::mutex> lock(this->myMutex);
+    this->myChanged.wait(lock, [this] {
+      return (int) this->myJobs.size() < this->myCapacity;
+    });
+    this->myJobs.push_back(std::move(task));
+  }
+  this->myChanged.notify_all();
+  return result;
+}
+
+void SaveQueue::wait()
+{
+  std::unique_lock<std::mutex> lock(this->myMutex);
+  this->myChanged.wait(lock, [this] {
+    return this->myJobs.empty() && !this->myRunning;
+  });
+}
+
+void SaveQueue::_workerLoop()
+{
+  std::unique_lock<std::mutex> lock(this->myMutex);
+  while (true) {
+    this->myChanged.wait(lock, [this] {
+      return this->myStopping || !this->myJobs.empty();
+    });
+    if (this->myJobs.empty()) return;
+
+    std::packaged_task<bool()> task= std::move(this->myJobs.front());
+    this->myJobs.pop_front();
+    this->myRunning= true;
+    lock.unlock();
+    this->myChanged.notify_all();
+    task();
+    lock.lock();
+    this->myRunning= false;
+    this->myChanged.notify_all();
+  }
+}
+
+SaveQueue& SaveQueue::shared()
+{
+  // the jobs use the shared thread pool, creating it first makes sure
+  // it is destroyed after this queue has finished them
+  ThreadPool::shared();
+  static SaveQueue queue(SHARED_QUEUE_CAPACITY);
+  return queue;
+}
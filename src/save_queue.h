@@ -0,0 +1,53 @@
+/*-----------------------------------------------
+ * Description: A background thread that runs
+ * queued jobs (saving images) one at a time in
+ * order, with a bounded queue so a producer that
+ * outpaces it waits instead of piling up frames.
+ ----------------------------------------------*/
+
+#ifndef save_queue_H_
+#define save_queue_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace agl
+{
+  class SaveQueue
+  {
+  public:
+    // Holds at most capacity jobs waiting behind the running one
+    SaveQueue(int capacity);
+    virtual ~SaveQueue();
+
+    SaveQueue(const SaveQueue&)= delete;
+    SaveQueue& operator=(const SaveQueue&)= delete;
+
+    // Queues the job and returns the future of its result. Blocks
+    // while the queue is full
+    std::shared_future<bool> push(const std::function<bool()>& job);
+
+    // Blocks until every queued job has finished
+    void wait();
+
+    // The queue behind Canvas::saveAsync
+    static SaveQueue& shared();
+
+  private:
+    void _workerLoop();
+
+    std::thread myWorker;
+    std::mutex myMutex;   // guards everything below
+    std::condition_variable myChanged;
+    std::deque<std::packaged_task<bool()>> myJobs;
+    int myCapacity;
+    bool myRunning= false; // whether the worker is in a job
+    bool myStopping= false;
+  };
+}
+
+#endif
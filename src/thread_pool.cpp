@@ -0,0 +1,154 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+using namespace agl;
+
+/**
+ * Workers sleep on a condition variable until parallelFor
+ * publishes a new job (a new generation), then pull indices
+ * from a shared atomic counter until none are left.
+*/
+
+// set for pool workers and for a caller while it runs its share of a job
+thread_local bool insidePool= false;
+
+// Rows per band in parallelRows, small enough to balance a few hundred
+// rows over many cores, large enough that a band outweighs handing it out
+const int DEFAULT_ROW_GRAIN= 16;
+
+ThreadPool::ThreadPool(int numThreads) :
+  myThreadCount(1), myNext(0), myRowGrain(DEFAULT_ROW_GRAIN)
+{
+  this->_startWorkers(numThreads);
+}
+
+ThreadPool::~ThreadPool()
+{
+  this->_stopWorkers();
+}
+
+void ThreadPool::_startWorkers(int numThreads)
+{
+  // the calling thread works too, so we need one less worker. They
+  // start out having seen the current job, no new job can start
+  // until the constructor or setThreadCount returns
+  for (int i= 1; i < numThreads; i++) {
+    this->myWorkers.push_back(
+      std::thread(&ThreadPool::_workerLoop, this, this->myGeneration));
+  }
+  this->myThreadCount= this->myWorkers.size() + 1;
+}
+
+void ThreadPool::_stopWorkers()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    this->myStopping= true;
+  }
+  this->myWake.notify_all();
+  for (std::thread& worker: this->myWorkers) {
+    worker.join();
+  }
+  this->myWorkers.clear();
+  this->myStopping= false;
+}
+
+void ThreadPool::setThreadCount(int numThreads)
+{
+  // waits for the running job to finish
+  std::lock_guard<std::mutex> submit(this->mySubmitMutex);
+  this->_stopWorkers();
+  this->_startWorkers(std::max(numThreads, 1));
+}
+
+void ThreadPool::setRowGrain(int rows)
+{
+  this->myRowGrain= std::max(rows, 1);
+}
+
+int ThreadPool::rowGrain() const
+{
+  return this->myRowGrain;
+}
+
+int ThreadPool::threadCount() const
+{
+  // myWorkers is only safe to read under mySubmitMutex
+  return this->myThreadCount;
+}
+
+ThreadPool& ThreadPool::shared()
+{
+  static ThreadPool pool(std::max((int) std::thread::hardware_concurrency(), 1));
+  return pool;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& task)
+{
+  if (count <= 0) return;
+
+  if (this->myThreadCount == 1 || count == 1 || insidePool) {
+    for (int i= 0; i < count; i++) {
+      task(i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> submit(this->mySubmitMutex);
+  {
+    std::lock_guard<std::mutex> lock(this->myMutex);
+    this->myTask= &task;
+    this->myCount= count;
+    this->myNext= 0;
+    this->myActive= this->myWorkers.size();
+    this->myGeneration++;
+  }
+  this->myWake.notify_all();
+
+  insidePool= true;
+  this->_runTasks();
+  insidePool= false;
+
+  // every worker has to check in, so none can miss the next generation
+  std::unique_lock<std::mutex> lock(this->myMutex);
+  this->myDone.wait(lock, [this] { return this->myActive == 0; });
+  this->myTask= nullptr;
+}
+
+void ThreadPool::parallelRows(int numRows, 
+  const std::function<void(int, int)>& task)
+{
+  int grain= this->myRowGrain;
+  int numBands= (numRows + grain - 1) / grain;
+  this->parallelFor(numBands, [&](int band) {
+    task(band * grain, std::min((band + 1) * grain, numRows));
+  });
+}
+
+void ThreadPool::_runTasks()
+{
+  for (;;) {
+    int i= this->myNext.fetch_add(1);
+    if (i >= this->myCount) break;
+    (*this->myTask)(i);
+  }
+}
+
+void ThreadPool::_workerLoop(unsigned long seen)
+{
+  insidePool= true;
+  for (;;) {
+    std::unique_lock<std::mutex> lock(this->myMutex);
+    this->myWake.wait(lock, [this, seen] { 
+      return this->myStopping || this->myGeneration != seen; 
+    });
+    if (this->myStopping) return;
+    seen= this->myGeneration;
+    lock.unlock();
+
+    this->_runTasks();
+
+    lock.lock();
+    if (--this->myActive == 0) this->myDone.notify_all();
+  }
+}
@@ -0,0 +1,77 @@
+/*-----------------------------------------------
+ * Description: A small pool of worker threads
+ * used to spread rasterization and image filter
+ * work over all of the cores.
+ ----------------------------------------------*/
+
+#ifndef thread_pool_H_
+#define thread_pool_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace agl
+{
+  class ThreadPool
+  {
+  public:
+    // Creates a pool where numThreads threads (counting the
+    // thread that calls parallelFor) work on each job
+    ThreadPool(int numThreads);
+    virtual ~ThreadPool();
+
+    ThreadPool(const ThreadPool&)= delete;
+    ThreadPool& operator=(const ThreadPool&)= delete;
+
+    // Returns the number of threads that work on a job
+    int threadCount() const;
+
+    // Calls task(i) for every i in [0, count) and returns once all of
+    // them have finished. Indices are handed out dynamically, so tasks
+    // may run in any order. A parallelFor called from inside a task
+    // runs serially on that thread instead of waiting on the pool.
+    void parallelFor(int count, const std::function<void(int)>& task);
+
+    // Splits the rows [0, numRows) into bands of rowGrain() rows and
+    // calls task(begin, end) for each band, in parallel like parallelFor
+    void parallelRows(int numRows, const std::function<void(int, int)>& task);
+
+    // Changes the number of threads that work on a job. It waits for
+    // the running job, so don't call it from inside a task
+    void setThreadCount(int numThreads);
+
+    // The number of rows in each band of parallelRows
+    void setRowGrain(int rows);
+    int rowGrain() const;
+
+    // The pool shared by the canvas and the image filters, 
+    // sized to the hardware
+    static ThreadPool& shared();
+
+  private:
+    void _workerLoop(unsigned long seen);
+    void _runTasks();
+    void _startWorkers(int numThreads);
+    void _stopWorkers();
+
+    std::vector<std::thread> myWorkers;
+    std::atomic<int> myThreadCount; // myWorkers.size() + 1, read without a lock
+    std::mutex mySubmitMutex; // only one job runs at a time
+    std::mutex myMutex;       // guards the job state below
+    std::condition_variable myWake;
+    std::condition_variable myDone;
+    const std::function<void(int)>* myTask= nullptr;
+    int myCount= 0;
+    std::atomic<int> myNext;
+    int myActive= 0;          // workers that have not finished the job
+    unsigned long myGeneration= 0;
+    bool myStopping= false;
+    int myRowGrain;
+  };
+}
+
+#endif